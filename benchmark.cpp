@@ -0,0 +1,628 @@
+#include "benchmark.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <CL/cl.h>
+#include "boid.hpp"
+#include "cl_setup.hpp"
+#include "cl_simulation.hpp"
+#include "multi_device_simulation.hpp"
+#include "native_simulation.hpp"
+#include "population.hpp"
+#include "trajectory.hpp"
+
+// Device time of a profiled command in milliseconds
+static double eventMs(cl_event event) {
+    cl_ulong start, end;
+    clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
+    clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
+    return (end - start) * 1e-6;
+}
+
+// Sum and release a list of profiled events
+static double sumEventsMs(std::vector<cl_event>& events) {
+    double total = 0.0;
+    for (cl_event event : events) {
+        total += eventMs(event);
+        clReleaseEvent(event);
+    }
+    events.clear();
+    return total;
+}
+
+std::vector<int> sweepBoidCounts(ClKernel kernel) {
+    switch (kernel) {
+    case ClKernel::Auto:
+        return {256, 512, 1024, 2048, 4096, 8192, 16384, 32768};
+    case ClKernel::Grid:
+        return {1000, 10000, 100000, 500000, 1000000};
+    default:
+        return {1000, 5000, 10000, 20000, 50000};
+    }
+}
+
+std::vector<size_t> sweepWorkGroupSizes() {
+    return {0, 32, 64, 128, 256};
+}
+
+// Timings of one measured configuration, and the index gap of its final state
+struct Measurement {
+    double seconds;
+    double uploadMs, kernelMs, readbackMs;
+    double indexGap;
+};
+
+// Mean distance in memory, in boids, between consecutive boids of the same grid cell.
+// Neighbors are searched cell by cell, so this stands in for the cache misses of the
+// search: about the boid count over the boids per cell in random order, near 1 once
+// the boids are sorted by cell.
+static double indexGap(const std::vector<Boid>& boids, const SimParams& params) {
+    float cellSize = params.cellSize();
+    int gridW = static_cast<int>(std::ceil(params.width / cellSize));
+    int gridH = static_cast<int>(std::ceil(params.height / cellSize));
+    std::vector<int> last(gridW * gridH, -1);
+    double total = 0.0;
+    long long pairs = 0;
+    for (int i = 0; i < static_cast<int>(boids.size()); ++i) {
+        int cx = std::min(std::max(static_cast<int>(boids[i].x / cellSize), 0), gridW - 1);
+        int cy = std::min(std::max(static_cast<int>(boids[i].y / cellSize), 0), gridH - 1);
+        int& previous = last[cy * gridW + cx];
+        if (previous >= 0) {
+            total += i - previous;
+            ++pairs;
+        }
+        previous = i;
+    }
+    return pairs > 0 ? total / pairs : 0.0;
+}
+
+// Fresh, identical initial state for every configuration
+static std::vector<Boid> initialBoids(const SimParams& params, int numBoids) {
+    std::vector<Boid> boids(numBoids);
+    randomBoids(boids, params.width, params.height, params.seed);
+    return boids;
+}
+
+// Print one configuration and append it to the CSV file
+static void report(std::ofstream& csv, const std::string& device, const Simulation& simulation, size_t workGroupSize,
+                   int sortInterval, const BenchmarkOptions& options, const Measurement& measurement) {
+    double stepsPerSec = options.steps / measurement.seconds;
+    double nsPerBoidStep = measurement.seconds * 1e9 / (static_cast<double>(options.steps) * simulation.size());
+
+    std::cout << simulation.name() << " boids=" << simulation.size()
+              << " work_group=" << (workGroupSize ? std::to_string(workGroupSize) : std::string("auto"))
+              << " sort=" << (sortInterval ? std::to_string(sortInterval) : std::string("off"))
+              << " steps=" << options.steps << ": "
+              << stepsPerSec << " steps/s, " << nsPerBoidStep << " ns/boid-step"
+              << " (upload " << measurement.uploadMs << " ms, kernels " << measurement.kernelMs
+              << " ms, readback " << measurement.readbackMs << " ms, index gap " << measurement.indexGap << ")" << std::endl;
+
+    if (csv.is_open()) {
+        csv << '"' << device << "\"," << simulation.name() << ',' << simulation.size() << ',' << workGroupSize << ','
+            << options.steps << ',' << measurement.seconds << ',' << stepsPerSec << ',' << nsPerBoidStep << ','
+            << measurement.uploadMs << ',' << measurement.kernelMs << ',' << measurement.readbackMs << ','
+            << sortInterval << ',' << measurement.indexGap << '\n';
+    }
+}
+
+// OpenCL backend, timed with profiling events
+static Measurement measureOpenCL(ClSimulation& simulation, cl_command_queue queue, const BenchmarkOptions& options) {
+    Measurement measurement;
+    std::vector<Boid> boids = initialBoids(options.params, simulation.size());
+
+    cl_event uploadEvent;
+    simulation.upload(boids.data(), &uploadEvent);
+    measurement.uploadMs = eventMs(uploadEvent);
+    clReleaseEvent(uploadEvent);
+
+    // Warm up (first launches may include JIT work)
+    simulation.step();
+    clFinish(queue);
+
+    std::vector<cl_event> kernelEvents;
+    std::vector<cl_event> readbackEvents;
+    measurement.kernelMs = 0.0;
+    auto start = std::chrono::steady_clock::now();
+    for (int step = 1; step <= options.steps; ++step) {
+        simulation.step(&kernelEvents);
+        if (step % options.stepsPerFrame == 0) {
+            cl_event event;
+            clEnqueueReadBuffer(queue, simulation.state(), CL_FALSE, 0, sizeof(Boid) * boids.size(), boids.data(), 0, NULL, &event);
+            readbackEvents.push_back(event);
+        }
+        // Keep the number of live events bounded on long runs
+        if (kernelEvents.size() >= 4096) {
+            clFinish(queue);
+            measurement.kernelMs += sumEventsMs(kernelEvents);
+        }
+    }
+    clFinish(queue);
+    measurement.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    measurement.kernelMs += sumEventsMs(kernelEvents);
+    measurement.readbackMs = sumEventsMs(readbackEvents);
+    // The gap is measured in memory order: download() would put the boids back in
+    // upload order, which is random whether or not they were sorted
+    clEnqueueReadBuffer(queue, simulation.state(), CL_TRUE, 0, sizeof(Boid) * boids.size(), boids.data(), 0, NULL, NULL);
+    measurement.indexGap = indexGap(boids, options.params);
+    return measurement;
+}
+
+// Any backend, timed on the host
+static Measurement measureHost(Simulation& simulation, const BenchmarkOptions& options) {
+    typedef std::chrono::steady_clock Clock;
+    Measurement measurement;
+    std::vector<Boid> boids = initialBoids(options.params, simulation.size());
+
+    auto uploadStart = Clock::now();
+    simulation.upload(boids.data());
+    measurement.uploadMs = std::chrono::duration<double, std::milli>(Clock::now() - uploadStart).count();
+
+    simulation.step();
+
+    measurement.kernelMs = 0.0;
+    measurement.readbackMs = 0.0;
+    auto start = Clock::now();
+    for (int step = 1; step <= options.steps; ++step) {
+        auto stepStart = Clock::now();
+        simulation.step();
+        auto stepEnd = Clock::now();
+        measurement.kernelMs += std::chrono::duration<double, std::milli>(stepEnd - stepStart).count();
+        if (step % options.stepsPerFrame == 0) {
+            simulation.download(boids.data());
+            measurement.readbackMs += std::chrono::duration<double, std::milli>(Clock::now() - stepEnd).count();
+        }
+    }
+    measurement.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    simulation.download(boids.data());
+    measurement.indexGap = indexGap(boids, options.params);
+    return measurement;
+}
+
+static int runOpenCLBenchmark(const BenchmarkOptions& options, std::ofstream& csv) {
+    // Startup covers everything before the first step: source, context, queue and program
+    auto startupStart = std::chrono::steady_clock::now();
+    std::string kernelCode;
+    if (!loadKernelSource("boid.cl", kernelCode)) {
+        std::cerr << "Failed to open kernel file." << std::endl;
+        return 1;
+    }
+
+    // Initialize OpenCL, any device will do unless one was selected
+    cl_platform_id platform;
+    cl_device_id device;
+    if (!pickDevice(platform, device, options.deviceSelector)) {
+        std::cerr << "No OpenCL device found." << std::endl;
+        return 1;
+    }
+
+    char deviceName[256];
+    clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(deviceName), deviceName, NULL);
+    size_t maxWorkGroupSize;
+    clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &maxWorkGroupSize, NULL);
+    std::cout << "Device: " << deviceName << std::endl;
+
+    cl_context context = clCreateContext(NULL, 1, &device, NULL, NULL, NULL);
+    cl_int command_queue_result;
+    cl_queue_properties queue_properties[] = {CL_QUEUE_PROPERTIES, CL_QUEUE_PROFILING_ENABLE, 0};
+    cl_command_queue queue = clCreateCommandQueueWithProperties(context, device, queue_properties, &command_queue_result);
+    if (command_queue_result != CL_SUCCESS) {
+        std::cerr << "Failed to create a profiling command queue." << std::endl;
+        clReleaseContext(context);
+        return 1;
+    }
+    bool fromCache = false;
+    cl_program program = buildProgram(context, device, kernelCode, kernelBuildOptions(options.params), &fromCache);
+    if (program == NULL) {
+        clReleaseCommandQueue(queue);
+        clReleaseContext(context);
+        return 1;
+    }
+    double startupMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startupStart).count();
+    std::cout << "Startup: " << startupMs << " ms (program " << (fromCache ? "loaded from cache" : "built from source")
+              << ")" << std::endl;
+
+    // With populations, every configuration is also measured with plain flocking
+    SimParams plainParams = plainFlocking(options.params);
+    cl_program plainProgram = NULL;
+    if (options.params.populations()) {
+        plainProgram = buildProgram(context, device, kernelCode, kernelBuildOptions(plainParams));
+        if (plainProgram == NULL) {
+            clReleaseProgram(program);
+            clReleaseCommandQueue(queue);
+            clReleaseContext(context);
+            return 1;
+        }
+    }
+
+    // Best steps/sec of every kernel at every boid count, of every sort interval, and of
+    // plain flocking
+    std::map<int, std::map<std::string, double>> best;
+    std::map<int, std::map<int, double>> bestSorted;
+    std::map<int, double> bestPlain;
+    for (int numBoids : options.boidCounts) {
+        for (ClKernel kernel : options.kernels) {
+            for (size_t workGroupSize : options.workGroupSizes) {
+                if (workGroupSize > maxWorkGroupSize)
+                    continue;
+
+                bool measuredUnsorted = false;
+                for (int sortInterval : options.sortIntervals) {
+                    ClSimulation simulation(context, device, queue, program, options.params, numBoids, kernel, workGroupSize);
+                    if (!simulation.ready())
+                        break;
+                    simulation.setSortInterval(sortInterval);
+                    // Kernels that never sort are measured once
+                    if (simulation.sortInterval() == 0) {
+                        if (measuredUnsorted)
+                            continue;
+                        measuredUnsorted = true;
+                    }
+                    Measurement measurement = measureOpenCL(simulation, queue, options);
+                    report(csv, deviceName, simulation, workGroupSize, simulation.sortInterval(), options, measurement);
+
+                    double& stepsPerSec = best[numBoids][simulation.name()];
+                    stepsPerSec = std::max(stepsPerSec, options.steps / measurement.seconds);
+                    if (options.sortIntervals.size() > 1 && std::string(simulation.name()).compare(0, 11, "opencl-grid") == 0) {
+                        double& sortedStepsPerSec = bestSorted[numBoids][simulation.sortInterval()];
+                        sortedStepsPerSec = std::max(sortedStepsPerSec, options.steps / measurement.seconds);
+                    }
+
+                    if (plainProgram != NULL) {
+                        ClSimulation plain(context, device, queue, plainProgram, plainParams, numBoids, kernel, workGroupSize);
+                        plain.setSortInterval(sortInterval);
+                        Measurement plainMeasurement = measureOpenCL(plain, queue, options);
+                        report(csv, deviceName, plain, workGroupSize, plain.sortInterval(), options, plainMeasurement);
+                        double& plainStepsPerSec = bestPlain[numBoids];
+                        plainStepsPerSec = std::max(plainStepsPerSec, options.steps / plainMeasurement.seconds);
+                    }
+                }
+            }
+        }
+    }
+
+    // Fastest kernel per boid count, the crossover TILED_MAX_BOIDS should be set from
+    if (options.kernels.size() > 1) {
+        std::cout << "Fastest kernel:" << std::endl;
+        for (const auto& count : best) {
+            auto fastest = count.second.begin();
+            for (auto it = count.second.begin(); it != count.second.end(); ++it)
+                if (it->second > fastest->second)
+                    fastest = it;
+            std::cout << "  boids=" << count.first << ": " << fastest->first << " (" << fastest->second << " steps/s)" << std::endl;
+        }
+    }
+
+    // Grid speedup of every sort interval over never sorting
+    if (!bestSorted.empty()) {
+        std::cout << "Spatial sort speedup (grid):" << std::endl;
+        for (const auto& count : bestSorted) {
+            auto unsorted = count.second.find(0);
+            if (unsorted == count.second.end())
+                continue;
+            for (const auto& interval : count.second) {
+                if (interval.first != 0)
+                    std::cout << "  boids=" << count.first << " sort=" << interval.first << ": "
+                              << interval.second / unsorted->second << "x" << std::endl;
+            }
+        }
+    }
+
+    // Extra time per step of species, predators and the steering field
+    if (!bestPlain.empty()) {
+        std::cout << "Population overhead over plain flocking (grid):" << std::endl;
+        for (const auto& count : bestPlain) {
+            double stepsPerSec = best[count.first]["opencl-grid-populations"];
+            std::cout << "  boids=" << count.first << ": " << (count.second / stepsPerSec - 1.0) * 100.0 << "% per step"
+                      << std::endl;
+        }
+    }
+
+    // Clean up
+    if (plainProgram != NULL)
+        clReleaseProgram(plainProgram);
+    clReleaseProgram(program);
+    clReleaseCommandQueue(queue);
+    clReleaseContext(context);
+    return 0;
+}
+
+static int runMultiDeviceBenchmark(const BenchmarkOptions& options, std::ofstream& csv) {
+    std::string kernelCode;
+    if (!loadKernelSource("boid.cl", kernelCode)) {
+        std::cerr << "Failed to open kernel file." << std::endl;
+        return 1;
+    }
+
+    std::vector<cl_device_id> devices = pickDevices(options.deviceSelector, options.subDevices);
+    if (devices.empty())
+        return 1;
+
+    // Name the configuration after its devices
+    std::string device;
+    for (cl_device_id strip : devices) {
+        char deviceName[256];
+        clGetDeviceInfo(strip, CL_DEVICE_NAME, sizeof(deviceName), deviceName, NULL);
+        device += (device.empty() ? "" : " + ") + std::string(deviceName);
+    }
+    std::cout << "Devices: " << device << std::endl;
+
+    // Strips exchange boids through the host every step, so time the whole step there
+    for (int numBoids : options.boidCounts) {
+        for (size_t workGroupSize : options.workGroupSizes) {
+            MultiDeviceSimulation simulation(devices, kernelCode, options.params, numBoids, workGroupSize);
+            if (!simulation.ready()) {
+                for (cl_device_id strip : devices)
+                    clReleaseDevice(strip);
+                return 1;
+            }
+            report(csv, device, simulation, workGroupSize, 0, options, measureHost(simulation, options));
+        }
+    }
+
+    for (cl_device_id strip : devices)
+        clReleaseDevice(strip);
+    return 0;
+}
+
+static int runNativeBenchmark(const BenchmarkOptions& options, std::ofstream& csv) {
+    for (int numBoids : options.boidCounts) {
+        NativeSimulation simulation(options.params, numBoids, options.bruteForce, options.threads);
+        std::string device = "native (" + std::to_string(simulation.threads()) + " threads)";
+        if (numBoids == options.boidCounts.front())
+            std::cout << "Device: " << device << std::endl;
+        report(csv, device, simulation, 0, 0, options, measureHost(simulation, options));
+    }
+    return 0;
+}
+
+// Largest velocity difference the grid may have from the brute-force kernel after one
+// step (see the grid pipeline in boid.cl)
+static const float GRID_VELOCITY_BOUND = 1e-4f;
+
+// Step the grid and the brute-force kernel once from the same state and return the
+// largest difference of a velocity component between them (infinity when workGroupSize
+// is rejected)
+static float gridVelocityError(cl_context context, cl_device_id device, cl_command_queue queue, cl_program program,
+                               const SimParams& params, const std::vector<Boid>& initial, size_t workGroupSize) {
+    int numBoids = static_cast<int>(initial.size());
+    ClSimulation grid(context, device, queue, program, params, numBoids, ClKernel::Grid, workGroupSize);
+    ClSimulation bruteForce(context, device, queue, program, params, numBoids, ClKernel::BruteForce, workGroupSize);
+    if (!grid.ready() || !bruteForce.ready())
+        return INFINITY;
+    grid.upload(initial.data());
+    bruteForce.upload(initial.data());
+    grid.step();
+    bruteForce.step();
+
+    // Both downloads are in upload order
+    std::vector<Boid> gridBoids(numBoids), bruteForceBoids(numBoids);
+    grid.download(gridBoids.data());
+    bruteForce.download(bruteForceBoids.data());
+    float largest = 0.0f;
+    for (int i = 0; i < numBoids; ++i) {
+        largest = std::max(largest, std::fabs(gridBoids[i].vx - bruteForceBoids[i].vx));
+        largest = std::max(largest, std::fabs(gridBoids[i].vy - bruteForceBoids[i].vy));
+    }
+    return largest;
+}
+
+static int runVerification(const BenchmarkOptions& options) {
+    std::string kernelCode;
+    if (!loadKernelSource("boid.cl", kernelCode)) {
+        std::cerr << "Failed to open kernel file." << std::endl;
+        return 1;
+    }
+
+    cl_platform_id platform;
+    cl_device_id device;
+    if (!pickDevice(platform, device, options.deviceSelector)) {
+        std::cerr << "No OpenCL device found." << std::endl;
+        return 1;
+    }
+
+    char deviceName[256];
+    clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(deviceName), deviceName, NULL);
+    std::cout << "Device: " << deviceName << std::endl;
+
+    SimParams params = options.params;
+    params.deterministic = true;
+    cl_context context = clCreateContext(NULL, 1, &device, NULL, NULL, NULL);
+    cl_queue_properties queue_properties[] = {0};
+    cl_command_queue queue = clCreateCommandQueueWithProperties(context, device, queue_properties, NULL);
+    cl_program program = buildProgram(context, device, kernelCode, kernelBuildOptions(params));
+    if (program == NULL) {
+        clReleaseCommandQueue(queue);
+        clReleaseContext(context);
+        return 1;
+    }
+
+    int status = 0;
+    for (int numBoids : options.boidCounts) {
+        // The grid must compute the same velocities as the brute-force kernel
+        float velocityError = gridVelocityError(context, device, queue, program, params, initialBoids(params, numBoids),
+                                                options.workGroupSizes.front());
+        char line[128];
+        std::snprintf(line, sizeof(line), "grid vs brute force boids=%d: largest velocity difference %g after one step (bound %g)",
+                      numBoids, velocityError, GRID_VELOCITY_BOUND);
+        std::cout << line << std::endl;
+        if (velocityError > GRID_VELOCITY_BOUND) {
+            std::cout << "  NOT within the bound" << std::endl;
+            status = 1;
+        }
+
+        for (ClKernel kernel : options.kernels) {
+            for (size_t workGroupSize : options.workGroupSizes) {
+                // Two device runs that must agree exactly, and the CPU reference
+                ClSimulation first(context, device, queue, program, params, numBoids, kernel, workGroupSize);
+                ClSimulation second(context, device, queue, program, params, numBoids, kernel, workGroupSize);
+                if (!first.ready()) {
+                    status = 1;
+                    continue;
+                }
+                NativeSimulation reference(params, numBoids, std::string(first.name()) != "opencl-grid", options.threads);
+                std::vector<Boid> boids = initialBoids(params, numBoids);
+                first.upload(boids.data());
+                second.upload(boids.data());
+                reference.upload(boids.data());
+                std::cout << first.name() << " vs " << reference.name() << " boids=" << numBoids
+                          << " work_group=" << (workGroupSize ? std::to_string(workGroupSize) : std::string("auto")) << std::endl;
+
+                int divergedAt = 0;
+                double largestDrift = 0.0;
+                int largestDriftStep = 0;
+                for (int step = 1, nextReport = 1; step <= options.steps; ++step) {
+                    first.step();
+                    second.step();
+                    reference.step();
+                    BoidChecksum checksum = first.checksum();
+                    if (divergedAt == 0 && second.checksum() != checksum)
+                        divergedAt = step;
+                    reference.download(boids.data());
+                    double drift = checksum.distance(checksumBoids(boids.data(), numBoids), numBoids);
+                    if (drift > largestDrift) {
+                        largestDrift = drift;
+                        largestDriftStep = step;
+                    }
+
+                    // Report steps 1, 10, 100... and the last one
+                    if (step == nextReport || step == options.steps) {
+                        char line[128];
+                        std::snprintf(line, sizeof(line), "  step %d: checksum %016llx, drift from native %g", step,
+                                      static_cast<unsigned long long>(checksum.hash()), drift);
+                        std::cout << line << std::endl;
+                        if (step == nextReport)
+                            nextReport *= 10;
+                    }
+                }
+
+                if (divergedAt == 0) {
+                    std::cout << "  Reproducible: both device runs matched at every step" << std::endl;
+                } else {
+                    std::cout << "  NOT reproducible: the device runs differ from step " << divergedAt << std::endl;
+                    status = 1;
+                }
+                std::cout << "  Largest drift from native: " << largestDrift << " at step " << largestDriftStep << std::endl;
+            }
+        }
+    }
+
+    // Clean up
+    clReleaseProgram(program);
+    clReleaseCommandQueue(queue);
+    clReleaseContext(context);
+    return status;
+}
+
+// Step the first configuration and record its trajectory, in upload order
+static int runRecording(const BenchmarkOptions& options) {
+    int numBoids = options.boidCounts.front();
+    std::vector<Boid> boids = initialBoids(options.params, numBoids);
+
+    // OpenCL objects, only used by the OpenCL backend
+    cl_context context = NULL;
+    cl_command_queue queue = NULL;
+    cl_program program = NULL;
+    std::unique_ptr<Simulation> simulation;
+    if (options.native) {
+        simulation.reset(new NativeSimulation(options.params, numBoids, options.bruteForce, options.threads));
+    } else {
+        std::string kernelCode;
+        if (!loadKernelSource("boid.cl", kernelCode)) {
+            std::cerr << "Failed to open kernel file." << std::endl;
+            return 1;
+        }
+        cl_platform_id platform;
+        cl_device_id device;
+        if (!pickDevice(platform, device, options.deviceSelector)) {
+            std::cerr << "No OpenCL device found." << std::endl;
+            return 1;
+        }
+        context = clCreateContext(NULL, 1, &device, NULL, NULL, NULL);
+        cl_queue_properties queue_properties[] = {0};
+        queue = clCreateCommandQueueWithProperties(context, device, queue_properties, NULL);
+        program = buildProgram(context, device, kernelCode, kernelBuildOptions(options.params));
+        if (program == NULL) {
+            clReleaseCommandQueue(queue);
+            clReleaseContext(context);
+            return 1;
+        }
+        ClSimulation* clSimulation = new ClSimulation(context, device, queue, program, options.params, numBoids,
+                                                      options.kernels.front(), options.workGroupSizes.front());
+        clSimulation->setSortInterval(options.sortIntervals.front());
+        simulation.reset(clSimulation);
+        if (!clSimulation->ready()) {
+            simulation.reset();
+            clReleaseProgram(program);
+            clReleaseCommandQueue(queue);
+            clReleaseContext(context);
+            return 1;
+        }
+    }
+
+    int status = 0;
+    TrajectoryRecorder recorder(numBoids, options.params.width, options.params.height, options.recordInterval);
+    if (recorder.open(options.recordPath)) {
+        // Frames are copied out blocking, the writer quantizes and writes them meanwhile
+        auto recordFrame = [&](int step) {
+            Boid* frame = recorder.acquire(true);
+            simulation->download(frame);
+            recorder.submit(frame, step);
+        };
+        auto start = std::chrono::steady_clock::now();
+        simulation->upload(boids.data());
+        recordFrame(0);
+        for (int step = 1; step <= options.steps; ++step) {
+            simulation->step();
+            if (step % options.recordInterval == 0)
+                recordFrame(step);
+        }
+        recorder.close();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << simulation->name() << " boids=" << numBoids << " steps=" << options.steps << ": recorded "
+                  << recorder.recorded() << " frames to " << options.recordPath << " in " << seconds << " s" << std::endl;
+    } else {
+        std::cerr << "Failed to create " << options.recordPath << std::endl;
+        status = 1;
+    }
+
+    // Clean up, the simulation before the objects it was created with
+    simulation.reset();
+    if (program != NULL) {
+        clReleaseProgram(program);
+        clReleaseCommandQueue(queue);
+        clReleaseContext(context);
+    }
+    return status;
+}
+
+int runBenchmark(const BenchmarkOptions& options) {
+    if (options.verify)
+        return runVerification(options);
+    if (!options.recordPath.empty())
+        return runRecording(options);
+
+    // Append to the CSV file, writing the header only when it is new
+    std::ofstream csv;
+    if (!options.csvPath.empty()) {
+        bool exists = std::ifstream(options.csvPath).good();
+        csv.open(options.csvPath, std::ios::app);
+        if (!csv.is_open()) {
+            std::cerr << "Failed to open " << options.csvPath << std::endl;
+            return 1;
+        }
+        if (!exists)
+            csv << "device,backend,boids,work_group,steps,seconds,steps_per_sec,ns_per_boid_step,upload_ms,kernel_ms,readback_ms,sort_every,index_gap\n";
+    }
+
+    if (options.native)
+        return runNativeBenchmark(options, csv);
+    if (options.multiDevice)
+        return runMultiDeviceBenchmark(options, csv);
+    return runOpenCLBenchmark(options, csv);
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "cl_simulation.hpp"
+#include "params.hpp"
+
+// Settings of a headless benchmark run
+struct BenchmarkOptions {
+    // World and flocking rules (the boid count comes from boidCounts)
+    SimParams params;
+    // Measured steps per configuration (one warm-up step is run before them)
+    int steps = 1000;
+    // The state is read back once every stepsPerFrame steps, like a rendered frame
+    int stepsPerFrame = 1;
+    // OpenCL kernels to measure, each at every boid count; bruteForce selects the
+    // native backend's O(N^2) update
+    std::vector<ClKernel> kernels{ClKernel::Auto};
+    bool bruteForce = false;
+    // Use the native C++ backend instead of OpenCL, with this many threads (0 = all)
+    bool native = false;
+    unsigned threads = 0;
+    // OpenCL device selector (see findDevices); the multi-device mode splits the world
+    // over every matching device, or over subDevices sub-devices of the first one
+    std::string deviceSelector;
+    bool multiDevice = false;
+    unsigned subDevices = 0;
+    // Every combination of boid count and work-group size is measured (0 = runtime picks);
+    // the native backend has no work-groups and only uses the boid counts
+    std::vector<int> boidCounts;
+    std::vector<size_t> workGroupSizes;
+    // Spatial sort intervals of the grid kernel, each measured in turn (see
+    // ClSimulation::setSortInterval); kernels and backends that never sort run once
+    std::vector<int> sortIntervals{SORT_AUTO};
+    // Append one CSV row per configuration to this file when not empty
+    std::string csvPath;
+    // Instead of timing, check the deterministic mode (see runBenchmark)
+    bool verify = false;
+    // Instead of measuring every configuration, run the first one and record its
+    // trajectory into this file every recordInterval steps when not empty
+    std::string recordPath;
+    int recordInterval = 1;
+};
+
+// Boid counts and work-group sizes measured by --sweep. With ClKernel::Auto the
+// counts bracket the crossover between the tiled and the grid kernels.
+std::vector<int> sweepBoidCounts(ClKernel kernel);
+std::vector<size_t> sweepWorkGroupSizes();
+
+// Run the simulation without a window and print steps/sec, ns per boid-step and the
+// profiled upload/kernel/readback times of every configuration, and how scattered
+// neighbors are in memory at the end of the run. When several kernels are measured,
+// the fastest one for each boid count is listed at the end, and when several sort
+// intervals are, the speedup of sorting over not sorting. With populations (see
+// SimParams::populations), every configuration also runs with plain flocking, and the
+// extra time per step of the populations is listed at the end.
+//
+// With verify, every configuration instead runs twice in the deterministic mode next to
+// the native backend, from the same initial state. After every step the checksums of the
+// two device runs must be equal, and the one of the native run gives the drift from the
+// CPU reference; floating point differences grow over time, so it only stays small for
+// the first steps. Every boid count also runs one step with the grid and with the
+// brute-force kernel from the same state, and their velocities must agree to 1e-4.
+//
+// With recordPath, only the first configuration runs, for steps steps, and its
+// trajectory is recorded (see TrajectoryRecorder); no frame is dropped, the run waits
+// for the writer instead.
+// Returns the exit code (1 when a configuration is not reproducible or the grid is off).
+int runBenchmark(const BenchmarkOptions& options);
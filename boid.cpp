@@ -0,0 +1,52 @@
+#include "boid.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <random>
+
+void randomBoids(std::vector<Boid>& boids, float width, float height, uint32_t seed) {
+    // Uniform in [0, 1) from the top 24 bits, the precision of a float
+    std::mt19937 generator(seed);
+    auto uniform = [&generator]() { return static_cast<float>(generator() >> 8) * (1.0f / 16777216.0f); };
+    for (Boid& boid : boids) {
+        boid.x = uniform() * width;
+        boid.y = uniform() * height;
+        boid.vx = uniform() * 10.0f - 5.0f;
+        boid.vy = uniform() * 10.0f - 5.0f;
+    }
+}
+
+// Round to the nearest 1/65536, ties to even like convert_long_rte
+static int64_t fixedPoint(float value) {
+    return std::llrint(static_cast<double>(value) * 65536.0);
+}
+
+BoidChecksum checksumBoids(const Boid* boids, int numBoids) {
+    BoidChecksum checksum;
+    for (int i = 0; i < numBoids; ++i) {
+        checksum.x += fixedPoint(boids[i].x);
+        checksum.y += fixedPoint(boids[i].y);
+        checksum.vx += fixedPoint(boids[i].vx);
+        checksum.vy += fixedPoint(boids[i].vy);
+    }
+    return checksum;
+}
+
+uint64_t BoidChecksum::hash() const {
+    // FNV-1a over the four sums
+    uint64_t hash = 14695981039346656037ull;
+    for (int64_t sum : {x, y, vx, vy}) {
+        for (int byte = 0; byte < 8; ++byte) {
+            hash ^= (static_cast<uint64_t>(sum) >> (8 * byte)) & 0xff;
+            hash *= 1099511628211ull;
+        }
+    }
+    return hash;
+}
+
+double BoidChecksum::distance(const BoidChecksum& other, int numBoids) const {
+    int64_t largest = std::max({std::llabs(x - other.x), std::llabs(y - other.y),
+                                std::llabs(vx - other.vx), std::llabs(vy - other.vy)});
+    return largest / 65536.0 / numBoids;
+}
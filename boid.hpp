@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// Structure to represent a boid, must match the Boid struct in boid.cl
+struct Boid {
+    float x, y, vx, vy;
+};
+
+// Initialize boids with random positions and velocities. The generator is seeded with
+// seed and fully specified, so a seed gives the same flock on every platform.
+void randomBoids(std::vector<Boid>& boids, float width, float height, uint32_t seed);
+
+// Sums of every component of a state as 48.16 fixed point (checksum_boids in boid.cl).
+// The sums are exact, so they do not depend on the order of the boids, and a device
+// and the host get the same checksum for the same state.
+struct BoidChecksum {
+    int64_t x = 0, y = 0, vx = 0, vy = 0;
+
+    bool operator==(const BoidChecksum& other) const {
+        return x == other.x && y == other.y && vx == other.vx && vy == other.vy;
+    }
+    bool operator!=(const BoidChecksum& other) const { return !(*this == other); }
+
+    // The four sums mixed into one value, for printing
+    uint64_t hash() const;
+
+    // Largest difference of a mean component (world units) between two states of numBoids boids
+    double distance(const BoidChecksum& other, int numBoids) const;
+};
+
+BoidChecksum checksumBoids(const Boid* boids, int numBoids);
@@ -2,104 +2,642 @@ typedef struct {
     float x, y, vx, vy;
 } Boid;
 
-__kernel void update_boids(__global Boid* boids, const int num_boids, const float dt, const float width, const float height) {
+// Deterministic mode: keep every a * b + c as two rounded operations instead of letting
+// the compiler fuse them where it sees fit, so a rebuild of the same program cannot
+// change the rounding. Built-ins such as dot() may still fuse, so the deterministic build
+// spells them out. This only makes runs on one device reproducible: / and sqrt are not
+// correctly rounded everywhere, and the native backend sums neighbors in another order,
+// so other devices and the CPU reference drift away over time.
+#ifdef DETERMINISTIC
+#pragma OPENCL FP_CONTRACT OFF
+#endif
+
+// Flocking parameters
+// The host passes them as -D options to clBuildProgram (see kernelBuildOptions in
+// params.cpp); these defaults only apply when the program is built without them.
+// The grid pipeline bins boids into cells at least as large as the biggest radius,
+// so the 3x3 neighborhood of a cell always covers every boid that can influence it
+#ifndef COH_RADIUS
+#define COH_RADIUS 20.0f
+#endif
+#ifndef ALIGN_RADIUS
+#define ALIGN_RADIUS 30.0f
+#endif
+#ifndef SEP_RADIUS
+#define SEP_RADIUS 10.0f
+#endif
+#ifndef MAX_SPEED
+#define MAX_SPEED 10.0f
+#endif
+
+#ifndef COH_FACTOR
+#define COH_FACTOR 0.01f
+#endif
+#ifndef ALIGN_FACTOR
+#define ALIGN_FACTOR 0.05f
+#endif
+#ifndef SEP_FACTOR
+#define SEP_FACTOR 0.2f
+#endif
+
+// Running sums of the three flocking rules for one boid
+typedef struct {
+    float coh_x, coh_y;
+    float align_x, align_y;
+    float sep_x, sep_y;
+    int coh_count, align_count, sep_count;
+} Flock;
+
+Flock flock_init(void) {
+    Flock flock = {0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0, 0, 0};
+    return flock;
+}
+
+// Accumulate the contribution of a single neighbor
+void flock_accumulate(Flock* flock, Boid self, Boid other) {
+    float dx = other.x - self.x;
+    float dy = other.y - self.y;
+
+    float dist_sq = dx * dx + dy * dy;
+
+    if (dist_sq < COH_RADIUS * COH_RADIUS) {
+        flock->coh_x += other.x;
+        flock->coh_y += other.y;
+        flock->coh_count++;
+    }
+
+    if (dist_sq < ALIGN_RADIUS * ALIGN_RADIUS) {
+        flock->align_x += other.vx;
+        flock->align_y += other.vy;
+        flock->align_count++;
+    }
+
+    if (dist_sq < SEP_RADIUS * SEP_RADIUS) {
+        flock->sep_x -= dx / dist_sq;
+        flock->sep_y -= dy / dist_sq;
+        flock->sep_count++;
+    }
+}
+
+// Wrap around boundaries
+Boid wrap_boid(Boid boid, const float width, const float height) {
+    if (boid.x > width) boid.x = 0.0f;
+    if (boid.x < 0.0f) boid.x = width;
+    if (boid.y > height) boid.y = 0.0f;
+    if (boid.y < 0.0f) boid.y = height;
+    return boid;
+}
+
+// Limit speed, integrate the position and wrap it, so the buffers only ever hold
+// positions inside the world
+Boid flock_move(Boid self, const float max_speed, const float dt, const float width, const float height) {
+    // Limit speed
+    float speed_sq = self.vx * self.vx + self.vy * self.vy;
+    if (speed_sq > max_speed * max_speed) {
+        float scale = max_speed / sqrt(speed_sq);
+        self.vx *= scale;
+        self.vy *= scale;
+    }
+
+    // Update position
+    self.x += self.vx * dt;
+    self.y += self.vy * dt;
+    return wrap_boid(self, width, height);
+}
+
+// Apply the accumulated rules, then move the boid
+Boid flock_steer(Flock flock, Boid self, const float dt, const float width, const float height) {
+    // Apply cohesion rule
+    if (flock.coh_count > 0) {
+        float coh_x = flock.coh_x / flock.coh_count;
+        float coh_y = flock.coh_y / flock.coh_count;
+
+        self.vx += (coh_x - self.x) * COH_FACTOR;
+        self.vy += (coh_y - self.y) * COH_FACTOR;
+    }
+
+    // Apply alignment rule
+    if (flock.align_count > 0) {
+        float align_x = flock.align_x / flock.align_count;
+        float align_y = flock.align_y / flock.align_count;
+
+        self.vx += (align_x - self.vx) * ALIGN_FACTOR;
+        self.vy += (align_y - self.vy) * ALIGN_FACTOR;
+    }
+
+    // Apply separation rule
+    if (flock.sep_count > 0) {
+        self.vx += flock.sep_x * SEP_FACTOR;
+        self.vy += flock.sep_y * SEP_FACTOR;
+    }
+
+    return flock_move(self, MAX_SPEED, dt, width, height);
+}
+
+// Populations (POPULATIONS, see population.hpp), only run by the grid pipeline: every
+// boid belongs to one of SPECIES flocks, or is a predator (species SPECIES). Boids only
+// cohere and align with their own species, predators chase (cohere with) every other
+// boid within PREDATOR_RADIUS and everyone else flees from them. species_rules holds the
+// multipliers of the cohesion, alignment and separation factors and of the speed limit
+// of every species. All of it is summed in the same pass over the 3x3 neighborhood as
+// the plain rules, which are built without any of it.
+#ifdef POPULATIONS
+#ifndef SPECIES
+#define SPECIES 1
+#endif
+#ifndef PREDATOR_RADIUS
+#define PREDATOR_RADIUS 50.0f
+#endif
+#ifndef FLEE_FACTOR
+#define FLEE_FACTOR 0.5f
+#endif
+
+// Accumulate the contribution of a single neighbor, fleeing sums into flee
+void population_accumulate(Flock* flock, float2* flee, Boid self, const uchar kind, Boid other, const uchar other_kind) {
+    float dx = other.x - self.x;
+    float dy = other.y - self.y;
+
+    float dist_sq = dx * dx + dy * dy;
+    bool hunter = kind == SPECIES;
+    bool other_hunter = other_kind == SPECIES;
+
+    bool cohere = hunter ? (!other_hunter && dist_sq < PREDATOR_RADIUS * PREDATOR_RADIUS)
+                         : (other_kind == kind && dist_sq < COH_RADIUS * COH_RADIUS);
+    if (cohere) {
+        flock->coh_x += other.x;
+        flock->coh_y += other.y;
+        flock->coh_count++;
+    }
+
+    if (other_kind == kind && dist_sq < ALIGN_RADIUS * ALIGN_RADIUS) {
+        flock->align_x += other.vx;
+        flock->align_y += other.vy;
+        flock->align_count++;
+    }
+
+    if (dist_sq < SEP_RADIUS * SEP_RADIUS) {
+        flock->sep_x -= dx / dist_sq;
+        flock->sep_y -= dy / dist_sq;
+        flock->sep_count++;
+    }
+
+    if (!hunter && other_hunter && dist_sq < PREDATOR_RADIUS * PREDATOR_RADIUS) {
+        *flee -= (float2)(dx, dy) / dist_sq;
+    }
+}
+
+// flock_steer with the multipliers of the boid's species, plus fleeing and the push of
+// the steering field
+Boid population_steer(Flock flock, float2 flee, float2 push, Boid self, const float4 rules, const float dt,
+                      const float width, const float height) {
+    if (flock.coh_count > 0) {
+        float coh_x = flock.coh_x / flock.coh_count;
+        float coh_y = flock.coh_y / flock.coh_count;
+
+        self.vx += (coh_x - self.x) * (COH_FACTOR * rules.x);
+        self.vy += (coh_y - self.y) * (COH_FACTOR * rules.x);
+    }
+
+    if (flock.align_count > 0) {
+        float align_x = flock.align_x / flock.align_count;
+        float align_y = flock.align_y / flock.align_count;
+
+        self.vx += (align_x - self.vx) * (ALIGN_FACTOR * rules.y);
+        self.vy += (align_y - self.vy) * (ALIGN_FACTOR * rules.y);
+    }
+
+    if (flock.sep_count > 0) {
+        self.vx += flock.sep_x * (SEP_FACTOR * rules.z);
+        self.vy += flock.sep_y * (SEP_FACTOR * rules.z);
+    }
+
+    self.vx += flee.x * FLEE_FACTOR + push.x;
+    self.vy += flee.y * FLEE_FACTOR + push.y;
+    return flock_move(self, MAX_SPEED * rules.w, dt, width, height);
+}
+
+// Steering field (FIELD): velocity change of the obstacles and attractors, precomputed by
+// the host at the centers of field_cell sized cells and interpolated bilinearly in between
+float2 sample_field(const __global float2* restrict field, const int field_w, const int field_h, const float field_cell,
+                    const float x, const float y) {
+    float fx = clamp(x / field_cell - 0.5f, 0.0f, (float)(field_w - 1));
+    float fy = clamp(y / field_cell - 0.5f, 0.0f, (float)(field_h - 1));
+    int x0 = (int)fx;
+    int y0 = (int)fy;
+    int x1 = min(x0 + 1, field_w - 1);
+    int y1 = min(y0 + 1, field_h - 1);
+    float tx = fx - x0;
+    float ty = fy - y0;
+
+    float2 top = mix(field[y0 * field_w + x0], field[y0 * field_w + x1], tx);
+    float2 bottom = mix(field[y1 * field_w + x0], field[y1 * field_w + x1], tx);
+    return mix(top, bottom, ty);
+}
+#endif
+
+// Cell coordinates of a (wrapped) position, clamped to the grid
+int2 cell_coords(float x, float y, const float cell_size, const int grid_w, const int grid_h) {
+    int cx = clamp((int)(x / cell_size), 0, grid_w - 1);
+    int cy = clamp((int)(y / cell_size), 0, grid_h - 1);
+    return (int2)(cx, cy);
+}
+
+// Brute-force O(N^2) update: every boid visits every other boid.
+// State is double-buffered: boids_in is the previous step and is never written,
+// boids_out receives the next step, and the host swaps the two after every step.
+__kernel void update_boids(const __global Boid* restrict boids_in, __global Boid* restrict boids_out,
+                           const int num_boids, const float dt, const float width, const float height) {
     int index = get_global_id(0);
     if (index < num_boids) {
-        // Update boid position and velocity based on simple rules
-        float coh_radius = 20.0f;
-        float align_radius = 30.0f;
-        float sep_radius = 10.0f;
-        float max_speed = 10.0f;
-        float max_force = 0.1f;
-
-        float coh_factor = 0.01f;
-        float align_factor = 0.05f;
-        float sep_factor = 0.2f;
-
-        float coh_x = 0.0f, coh_y = 0.0f;
-        float align_x = 0.0f, align_y = 0.0f;
-        float sep_x = 0.0f, sep_y = 0.0f;
-        int coh_count = 0, align_count = 0, sep_count = 0;
-
-        // Wrap around boundaries for each boid
-        if (boids[index].x > width) boids[index].x = 0.0f;
-        if (boids[index].x < 0.0f) boids[index].x = width;
-        if (boids[index].y > height) boids[index].y = 0.0f;
-        if (boids[index].y < 0.0f) boids[index].y = height;
+        Boid self = boids_in[index];
 
         // Loop through neighboring boids
+        Flock flock = flock_init();
         for (int i = 0; i < num_boids; ++i) {
-
             if (i != index) {
-                float dx = boids[i].x - boids[index].x;
-                float dy = boids[i].y - boids[index].y;
+                flock_accumulate(&flock, self, boids_in[i]);
+            }
+        }
+
+        boids_out[index] = flock_steer(flock, self, dt, width, height);
+    }
+}
 
+// Tiled brute-force update for small flocks, where building a grid costs more than it saves.
+// Every work-group walks the whole flock one tile at a time: each work-item loads one boid
+// of the tile into local memory, so a neighbor is read from global memory once per
+// work-group instead of once per work-item. Boids are handled as float4 (x, y, vx, vy);
+// the cohesion and alignment sums are accumulated together as one float4, masked by
+// their radii. The sums run in the same order as in update_boids.
+// The local size must be the size of the tile, and every work-item takes part in the
+// loads and barriers, including those past the end of the flock.
+__kernel void update_boids_tiled(const __global float4* restrict boids_in, __global float4* restrict boids_out,
+                                 const int num_boids, const float dt, const float width, const float height,
+                                 __local float4* tile) {
+    int index = get_global_id(0);
+    int lid = get_local_id(0);
+    int lsize = get_local_size(0);
+    float4 self = boids_in[min(index, num_boids - 1)];
 
-                float dist_sq = dx * dx + dy * dy;
+    // xy: positions inside the cohesion radius, zw: velocities inside the alignment radius
+    float4 coh_align = (float4)(0.0f);
+    float2 sep = (float2)(0.0f);
+    int coh_count = 0, align_count = 0, sep_count = 0;
 
-                if (dist_sq < coh_radius * coh_radius) {
-                    coh_x += boids[i].x;
-                    coh_y += boids[i].y;
-                    coh_count++;
-                }
+    for (int base = 0; base < num_boids; base += lsize) {
+        // Stage one tile of neighbors
+        tile[lid] = (base + lid < num_boids) ? boids_in[base + lid] : (float4)(0.0f);
+        barrier(CLK_LOCAL_MEM_FENCE);
 
-                if (dist_sq < align_radius * align_radius) {
-                    align_x += boids[i].vx;
-                    align_y += boids[i].vy;
-                    align_count++;
-                }
+        int count = min(lsize, num_boids - base);
+        for (int j = 0; j < count; ++j) {
+            if (base + j != index) {
+                float4 other = tile[j];
+                float2 d = other.xy - self.xy;
+#ifdef DETERMINISTIC
+                float dist_sq = d.x * d.x + d.y * d.y;
+#else
+                float dist_sq = dot(d, d);
+#endif
 
-                if (dist_sq < sep_radius * sep_radius) {
-                    sep_x -= dx / dist_sq;
-                    sep_y -= dy / dist_sq;
+                int in_coh = dist_sq < COH_RADIUS * COH_RADIUS;
+                int in_align = dist_sq < ALIGN_RADIUS * ALIGN_RADIUS;
+                coh_align += other * (float4)((float)in_coh, (float)in_coh, (float)in_align, (float)in_align);
+                coh_count += in_coh;
+                align_count += in_align;
+
+                if (dist_sq < SEP_RADIUS * SEP_RADIUS) {
+                    sep -= d / dist_sq;
                     sep_count++;
                 }
             }
         }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
 
-        // Apply cohesion rule
-        if (coh_count > 0) {
-            coh_x /= coh_count;
-            coh_y /= coh_count;
+    if (index < num_boids) {
+        Flock flock = {coh_align.x, coh_align.y, coh_align.z, coh_align.w, sep.x, sep.y, coh_count, align_count, sep_count};
+        Boid boid = {self.x, self.y, self.z, self.w};
+        boid = flock_steer(flock, boid, dt, width, height);
+        boids_out[index] = (float4)(boid.x, boid.y, boid.vx, boid.vy);
+    }
+}
 
-            float coh_force_x = (coh_x - boids[index].x) * coh_factor;
-            float coh_force_y = (coh_y - boids[index].y) * coh_factor;
+// Grid pipeline, one kernel per stage:
+//   reset_cells -> count_cells -> scan_cells -> scatter_boids -> update_boids_grid
+// count_cells finds the cell of each boid and takes a rank inside that cell,
+// scan_cells turns the per-cell counts into start offsets, scatter_boids copies the
+// boids into a cell-sorted buffer and update_boids_grid only visits the 3x3 cells
+// around each boid. The forces are the same as in update_boids; only the order of the
+// floating point sums changes, so per-step velocities agree to within 1e-4 absolute
+// (checked by --verify, see GRID_VELOCITY_BOUND in benchmark.cpp).
+// Like update_boids, the pipeline reads boids_in and only writes boids_out.
 
-            boids[index].vx += coh_force_x;
-            boids[index].vy += coh_force_y;
-        }
+// Stage 1: clear the per-cell counters
+__kernel void reset_cells(__global int* cell_counts, const int num_cells) {
+    int index = get_global_id(0);
+    if (index < num_cells) {
+        cell_counts[index] = 0;
+    }
+}
 
-        // Apply alignment rule
-        if (align_count > 0) {
-            align_x /= align_count;
-            align_y /= align_count;
+// Stage 2: assign each boid to a cell and reserve a slot inside the cell.
+// The grid may only cover the grid_h rows of the world from row0 on (a strip of the
+// multi-device mode); boids outside it are clamped to its first or last row.
+__kernel void count_cells(const __global Boid* restrict boids_in, __global int* restrict boid_cells, __global int* restrict boid_ranks,
+                          volatile __global int* cell_counts, const int num_boids,
+                          const float cell_size, const int grid_w, const int grid_h, const int row0) {
+    int index = get_global_id(0);
+    if (index < num_boids) {
+        Boid self = boids_in[index];
+
+        int2 cell = cell_coords(self.x, self.y, cell_size, grid_w, row0 + grid_h);
+        cell.y = max(cell.y - row0, 0);
+        int cell_index = cell.y * grid_w + cell.x;
+        boid_cells[index] = cell_index;
+        boid_ranks[index] = atomic_inc(&cell_counts[cell_index]);
+    }
+}
+
+// Stage 3: exclusive prefix sum of the cell counts, run as a single work-group.
+// Each work-item sums a contiguous chunk of cells, the chunk totals are scanned in
+// local memory and the chunk is then written out serially.
+// cell_starts holds num_cells + 1 entries, the last one being the total boid count.
+__kernel void scan_cells(__global const int* cell_counts, __global int* cell_starts, const int num_cells, __local int* partial) {
+    int lid = get_local_id(0);
+    int lsize = get_local_size(0);
+    int chunk = (num_cells + lsize - 1) / lsize;
+    int begin = min(lid * chunk, num_cells);
+    int end = min(begin + chunk, num_cells);
+
+    // Sum this work-item's chunk
+    int sum = 0;
+    for (int c = begin; c < end; ++c) {
+        sum += cell_counts[c];
+    }
+    partial[lid] = sum;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Inclusive scan of the chunk totals
+    for (int offset = 1; offset < lsize; offset <<= 1) {
+        int value = (lid >= offset) ? partial[lid - offset] : 0;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        partial[lid] += value;
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
 
-            float align_force_x = (align_x - boids[index].vx) * align_factor;
-            float align_force_y = (align_y - boids[index].vy) * align_factor;
+    // Write the exclusive offsets of the chunk
+    int running = partial[lid] - sum;
+    for (int c = begin; c < end; ++c) {
+        cell_starts[c] = running;
+        running += cell_counts[c];
+    }
+    if (lid == lsize - 1) {
+        cell_starts[num_cells] = partial[lid];
+    }
+}
+
+// Stage 4: copy every boid into its slot of the cell-sorted buffer
+// (with POPULATIONS, and its species into the same slot of sorted_species)
+__kernel void scatter_boids(const __global Boid* restrict boids_in, const __global int* restrict boid_cells,
+                            const __global int* restrict boid_ranks, const __global int* restrict cell_starts,
+                            __global Boid* restrict sorted_boids, const int num_boids,
+                            const __global uchar* restrict species_in, __global uchar* restrict sorted_species) {
+    int index = get_global_id(0);
+    if (index < num_boids) {
+        int slot = cell_starts[boid_cells[index]] + boid_ranks[index];
+        sorted_boids[slot] = boids_in[index];
+#ifdef POPULATIONS
+        sorted_species[slot] = species_in[index];
+#endif
+    }
+}
 
-            boids[index].vx += align_force_x;
-            boids[index].vy += align_force_y;
+// Deterministic mode: the ranks taken with atomic_inc depend on scheduling, and with them
+// the order in which update_boids_grid sums the boids of a cell. This replaces them with
+// the position of the boid among the boids of its cell in memory order. The state has
+// just been sorted by cell, so the boids of a cell are contiguous.
+__kernel void rank_sorted_cells(const __global int* restrict boid_cells, __global int* restrict boid_ranks, const int num_boids) {
+    int index = get_global_id(0);
+    if (index < num_boids) {
+        int cell = boid_cells[index];
+        int first = index;
+        while (first > 0 && boid_cells[first - 1] == cell) {
+            --first;
         }
+        boid_ranks[index] = index - first;
+    }
+}
 
-        // Apply separation rule
-        if (sep_count > 0) {
-            float sep_force_x = sep_x * sep_factor;
-            float sep_force_y = sep_y * sep_factor;
+// Stage 5: flocking update that only visits the 3x3 neighborhood of the boid's cell.
+// The population arguments are only read with POPULATIONS, and the field with FIELD.
+__kernel void update_boids_grid(const __global Boid* restrict sorted_boids, const __global int* restrict boid_cells,
+                                const __global int* restrict boid_ranks, const __global int* restrict cell_starts,
+                                __global Boid* restrict boids_out, const int num_boids, const float dt,
+                                const float width, const float height,
+                                const float cell_size, const int grid_w, const int grid_h,
+                                const __global uchar* restrict sorted_species, __constant float4* species_rules,
+                                const __global float2* restrict field, const int field_w, const int field_h,
+                                const float field_cell) {
+    int index = get_global_id(0);
+    if (index < num_boids) {
+        int cell_index = boid_cells[index];
+        int self_slot = cell_starts[cell_index] + boid_ranks[index];
+        Boid self = sorted_boids[self_slot];
+        int cx = cell_index % grid_w;
+        int cy = cell_index / grid_w;
+#ifdef POPULATIONS
+        uchar kind = sorted_species[self_slot];
+        float2 flee = (float2)(0.0f);
+#endif
 
-            boids[index].vx += sep_force_x;
-            boids[index].vy += sep_force_y;
+        // Loop through the boids of the neighboring cells
+        Flock flock = flock_init();
+        for (int ny = max(cy - 1, 0); ny <= min(cy + 1, grid_h - 1); ++ny) {
+            for (int nx = max(cx - 1, 0); nx <= min(cx + 1, grid_w - 1); ++nx) {
+                int neighbor_cell = ny * grid_w + nx;
+                int end = cell_starts[neighbor_cell + 1];
+                for (int slot = cell_starts[neighbor_cell]; slot < end; ++slot) {
+                    if (slot != self_slot) {
+#ifdef POPULATIONS
+                        population_accumulate(&flock, &flee, self, kind, sorted_boids[slot], sorted_species[slot]);
+#else
+                        flock_accumulate(&flock, self, sorted_boids[slot]);
+#endif
+                    }
+                }
+            }
         }
 
-        // Limit speed
-        float speed_sq = boids[index].vx * boids[index].vx + boids[index].vy * boids[index].vy;
-        if (speed_sq > max_speed * max_speed) {
-            float scale = max_speed / sqrt(speed_sq);
-            boids[index].vx *= scale;
-            boids[index].vy *= scale;
+#ifdef POPULATIONS
+        float2 push = (float2)(0.0f);
+#ifdef FIELD
+        push = sample_field(field, field_w, field_h, field_cell, self.x, self.y);
+#endif
+        boids_out[index] = population_steer(flock, flee, push, self, species_rules[kind], dt, width, height);
+#else
+        boids_out[index] = flock_steer(flock, self, dt, width, height);
+#endif
+    }
+}
+
+// Spatial sort, run every few steps: reorder the boids by the Morton (Z-order) code of
+// their grid cell, so boids close in space are also close in memory. A stable LSD radix
+// sort over RADIX_BITS-bit digits runs on (key, boid index) pairs and leaves a
+// permutation: slot i of the sorted order holds the boid that was at permutation[i],
+// and permute_boids (or a gather like it for any other per-boid buffer) applies it.
+//   morton_keys -> (radix_histogram -> scan_cells -> radix_scatter) per digit -> permute_boids
+// Each work-item of the histogram and scatter stages owns a contiguous chunk of pairs.
+// Histograms are stored digit-major (digit * num_chunks + chunk), so one exclusive scan
+// of all of them gives every chunk its output offset per digit, and walking the chunk in
+// order keeps the sort stable.
+#define RADIX_BITS 4
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+
+// Spread the low 16 bits of v over the even bits
+uint morton_spread(uint v) {
+    v &= 0x0000ffff;
+    v = (v | (v << 8)) & 0x00ff00ff;
+    v = (v | (v << 4)) & 0x0f0f0f0f;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+}
+
+// Sort keys and the identity permutation
+__kernel void morton_keys(const __global Boid* restrict boids, __global uint* restrict keys, __global int* restrict permutation,
+                          const int num_boids, const float cell_size, const int grid_w, const int grid_h) {
+    int index = get_global_id(0);
+    if (index < num_boids) {
+        int2 cell = cell_coords(boids[index].x, boids[index].y, cell_size, grid_w, grid_h);
+        keys[index] = morton_spread(cell.x) | (morton_spread(cell.y) << 1);
+        permutation[index] = index;
+    }
+}
+
+// Count the digits at shift in every chunk
+__kernel void radix_histogram(const __global uint* restrict keys, __global int* restrict histograms,
+                              const int num_boids, const int shift, const int chunk, const int num_chunks) {
+    int index = get_global_id(0);
+    if (index < num_chunks) {
+        int counts[RADIX_BUCKETS];
+        for (int d = 0; d < RADIX_BUCKETS; ++d) {
+            counts[d] = 0;
+        }
+        int end = min((index + 1) * chunk, num_boids);
+        for (int i = index * chunk; i < end; ++i) {
+            counts[(keys[i] >> shift) & (RADIX_BUCKETS - 1)]++;
         }
+        for (int d = 0; d < RADIX_BUCKETS; ++d) {
+            histograms[d * num_chunks + index] = counts[d];
+        }
+    }
+}
+
+// Move every pair of a chunk to its sorted slot, in order
+__kernel void radix_scatter(const __global uint* restrict keys_in, const __global int* restrict permutation_in,
+                            __global uint* restrict keys_out, __global int* restrict permutation_out,
+                            const __global int* restrict offsets, const int num_boids, const int shift,
+                            const int chunk, const int num_chunks) {
+    int index = get_global_id(0);
+    if (index < num_chunks) {
+        int next[RADIX_BUCKETS];
+        for (int d = 0; d < RADIX_BUCKETS; ++d) {
+            next[d] = offsets[d * num_chunks + index];
+        }
+        int end = min((index + 1) * chunk, num_boids);
+        for (int i = index * chunk; i < end; ++i) {
+            uint key = keys_in[i];
+            int slot = next[(key >> shift) & (RADIX_BUCKETS - 1)]++;
+            keys_out[slot] = key;
+            permutation_out[slot] = permutation_in[i];
+        }
+    }
+}
+
+// Gather the boids and their upload index into sorted order (with POPULATIONS, their
+// species too)
+__kernel void permute_boids(const __global Boid* restrict boids_in, const __global int* restrict permutation,
+                            __global Boid* restrict boids_out, const int num_boids,
+                            const __global uchar* restrict species_in, __global uchar* restrict species_out,
+                            const __global int* restrict ids_in, __global int* restrict ids_out) {
+    int index = get_global_id(0);
+    if (index < num_boids) {
+        boids_out[index] = boids_in[permutation[index]];
+        ids_out[index] = ids_in[permutation[index]];
+#ifdef POPULATIONS
+        species_out[index] = species_in[permutation[index]];
+#endif
+    }
+}
+
+// Put sorted boids back in upload order: slot i holds the boid uploaded at ids[i]
+__kernel void unpermute_boids(const __global Boid* restrict boids_in, const __global int* restrict ids,
+                              __global Boid* restrict boids_out, const int num_boids) {
+    int index = get_global_id(0);
+    if (index < num_boids) {
+        boids_out[ids[index]] = boids_in[index];
+    }
+}
 
-        // Update position
-        boids[index].x += boids[index].vx * dt;
-        boids[index].y += boids[index].vy * dt;
+// Checksum of the state (BoidChecksum on the host): every component summed as 48.16 fixed
+// point. Each work-item sums every global-size-th boid, each work-group reduces those sums
+// in local memory and writes one partial sum, and the host adds the partial sums up.
+// Integer sums are exact, so the checksum depends neither on the order of the boids nor
+// on the launch size. The local size must be a power of two.
+__kernel void checksum_boids(const __global Boid* restrict boids, __global long4* restrict partials, const int num_boids,
+                             __local long4* scratch) {
+    int lid = get_local_id(0);
+
+    long4 sum = (long4)(0);
+    for (int index = get_global_id(0); index < num_boids; index += get_global_size(0)) {
+        Boid self = boids[index];
+        sum += convert_long4_rte((float4)(self.x, self.y, self.vx, self.vy) * 65536.0f);
+    }
+    scratch[lid] = sum;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (int offset = get_local_size(0) / 2; offset > 0; offset >>= 1) {
+        if (lid < offset) {
+            scratch[lid] += scratch[lid + offset];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    if (lid == 0) {
+        partials[get_group_id(0)] = scratch[0];
+    }
+}
+
+// Copy boid positions into the vertex buffer shared with OpenGL
+__kernel void write_positions(const __global Boid* restrict boids, __global float2* restrict positions, const int num_boids) {
+    int index = get_global_id(0);
+    if (index < num_boids) {
+        positions[index] = (float2)(boids[index].x, boids[index].y);
+    }
+}
+
+// Multi-device mode: after a step, split the boids a strip [y0, y1) owns into the
+// ones it keeps and the ones that crossed into another strip. Kept boids closer than
+// halo to a border are also copied out, for the neighboring strip to use as neighbors.
+// outbox holds three regions of capacity boids each: migrants, lower halo, upper halo.
+// counters holds the number of kept boids followed by the size of each region.
+__kernel void split_strip(const __global Boid* restrict boids, __global Boid* restrict kept, __global Boid* restrict outbox,
+                          volatile __global int* counters, const int num_boids, const int capacity,
+                          const float y0, const float y1, const float halo) {
+    int index = get_global_id(0);
+    if (index < num_boids) {
+        Boid self = boids[index];
+
+        if (self.y < y0 || self.y >= y1) {
+            outbox[atomic_inc(&counters[1])] = self;
+        } else {
+            kept[atomic_inc(&counters[0])] = self;
+            if (self.y < y0 + halo) {
+                outbox[capacity + atomic_inc(&counters[2])] = self;
+            }
+            if (self.y >= y1 - halo) {
+                outbox[2 * capacity + atomic_inc(&counters[3])] = self;
+            }
+        }
     }
 }
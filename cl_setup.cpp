@@ -0,0 +1,326 @@
+#include "cl_setup.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <random>
+
+// Directory of the program binary cache, empty when disabled
+static std::string binaryCacheDir = ".boid_cache";
+
+bool loadKernelSource(const char* path, std::string& source) {
+    std::ifstream kernelFile(path);
+    if (!kernelFile.is_open())
+        return false;
+
+    source.assign((std::istreambuf_iterator<char>(kernelFile)), std::istreambuf_iterator<char>());
+    return true;
+}
+
+// String-valued device info
+static std::string deviceString(cl_device_id device, cl_device_info info) {
+    char value[256];
+    if (clGetDeviceInfo(device, info, sizeof(value), value, NULL) != CL_SUCCESS)
+        return std::string();
+    return value;
+}
+
+static std::string lowercase(std::string text) {
+    std::transform(text.begin(), text.end(), text.begin(), [](unsigned char c) { return std::tolower(c); });
+    return text;
+}
+
+static const char* typeName(cl_device_type type) {
+    if (type & CL_DEVICE_TYPE_GPU)
+        return "GPU";
+    if (type & CL_DEVICE_TYPE_CPU)
+        return "CPU";
+    if (type & CL_DEVICE_TYPE_ACCELERATOR)
+        return "Accelerator";
+    return "Unknown";
+}
+
+std::vector<DeviceInfo> listDevices() {
+    std::vector<DeviceInfo> devices;
+
+    // Get platform IDs, as many as the runtime reports
+    cl_uint platform_count;
+    if (clGetPlatformIDs(0, NULL, &platform_count) != CL_SUCCESS || platform_count == 0)
+        return devices;
+    std::vector<cl_platform_id> platforms(platform_count);
+    if (clGetPlatformIDs(platform_count, platforms.data(), NULL) != CL_SUCCESS)
+        return devices;
+
+    // Iterate over available platforms and their devices
+    for (cl_uint i = 0; i < platform_count; ++i) {
+        char platform_name[256] = "";
+        clGetPlatformInfo(platforms[i], CL_PLATFORM_NAME, sizeof(platform_name), platform_name, NULL);
+
+        cl_uint devices_count;
+        if (clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_ALL, 0, NULL, &devices_count) != CL_SUCCESS || devices_count == 0)
+            continue;
+        std::vector<cl_device_id> platform_devices(devices_count);
+        if (clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_ALL, devices_count, platform_devices.data(), NULL) != CL_SUCCESS)
+            continue;
+
+        for (cl_uint j = 0; j < devices_count; ++j) {
+            DeviceInfo info;
+            info.platform = platforms[i];
+            info.device = platform_devices[j];
+            info.platformName = platform_name;
+            info.name = deviceString(info.device, CL_DEVICE_NAME);
+            info.vendor = deviceString(info.device, CL_DEVICE_VENDOR);
+            clGetDeviceInfo(info.device, CL_DEVICE_TYPE, sizeof(info.type), &info.type, NULL);
+            clGetDeviceInfo(info.device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(info.computeUnits), &info.computeUnits, NULL);
+            clGetDeviceInfo(info.device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(info.maxWorkGroupSize), &info.maxWorkGroupSize, NULL);
+            clGetDeviceInfo(info.device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(info.maxMemAllocSize), &info.maxMemAllocSize, NULL);
+            devices.push_back(info);
+        }
+    }
+    return devices;
+}
+
+void printDevices(const std::vector<DeviceInfo>& devices, std::ostream& out) {
+    for (size_t i = 0; i < devices.size(); ++i) {
+        const DeviceInfo& info = devices[i];
+        out << i << ": " << info.name << " (" << typeName(info.type) << ", vendor: " << info.vendor
+            << ", platform: " << info.platformName << ", compute units: " << info.computeUnits
+            << ", max work-group size: " << info.maxWorkGroupSize
+            << ", max allocation: " << (info.maxMemAllocSize >> 20) << " MiB)" << std::endl;
+    }
+}
+
+std::vector<DeviceInfo> findDevices(const std::vector<DeviceInfo>& devices, const std::string& selector) {
+    std::vector<DeviceInfo> found;
+    std::string query = lowercase(selector);
+
+    // Default: GPUs first, then everything else
+    if (query.empty()) {
+        for (const DeviceInfo& info : devices)
+            if (info.type & CL_DEVICE_TYPE_GPU)
+                found.push_back(info);
+        for (const DeviceInfo& info : devices)
+            if (!(info.type & CL_DEVICE_TYPE_GPU))
+                found.push_back(info);
+        return found;
+    }
+
+    // Index into the device list
+    if (std::all_of(query.begin(), query.end(), [](unsigned char c) { return std::isdigit(c); })) {
+        size_t index = std::strtoul(query.c_str(), NULL, 10);
+        if (index < devices.size())
+            found.push_back(devices[index]);
+        return found;
+    }
+
+    for (const DeviceInfo& info : devices) {
+        std::string name = lowercase(info.name);
+        std::string vendor = lowercase(info.vendor);
+        bool match;
+        if (query == "all")
+            match = true;
+        else if (query == "gpu")
+            match = (info.type & CL_DEVICE_TYPE_GPU) != 0;
+        else if (query == "cpu")
+            match = (info.type & CL_DEVICE_TYPE_CPU) != 0;
+        else if (query == "accelerator")
+            match = (info.type & CL_DEVICE_TYPE_ACCELERATOR) != 0;
+        else if (query.compare(0, 5, "name:") == 0)
+            match = name.find(query.substr(5)) != std::string::npos;
+        else if (query.compare(0, 7, "vendor:") == 0)
+            match = vendor.find(query.substr(7)) != std::string::npos;
+        else
+            match = name.find(query) != std::string::npos || vendor.find(query) != std::string::npos;
+
+        if (match)
+            found.push_back(info);
+    }
+    return found;
+}
+
+bool pickDevice(cl_platform_id& platform, cl_device_id& device, const std::string& selector) {
+    std::vector<DeviceInfo> found = findDevices(listDevices(), selector);
+    if (found.empty())
+        return false;
+
+    platform = found.front().platform;
+    device = found.front().device;
+    return true;
+}
+
+std::vector<cl_device_id> pickDevices(const std::string& selector, unsigned subDevices) {
+    std::vector<cl_device_id> devices;
+    std::vector<DeviceInfo> all = listDevices();
+    std::vector<DeviceInfo> found;
+    // GPUs can rarely be partitioned, so sub-devices default to a CPU
+    if (subDevices > 1 && selector.empty())
+        found = findDevices(all, "cpu");
+    if (found.empty())
+        found = findDevices(all, selector);
+    if (found.empty()) {
+        std::cerr << "No OpenCL device found." << std::endl;
+        return devices;
+    }
+
+    if (subDevices > 1) {
+        devices = splitDevice(found.front().device, subDevices);
+        if (devices.empty())
+            std::cerr << "Failed to split " << found.front().name << " into " << subDevices << " sub-devices." << std::endl;
+        return devices;
+    }
+    for (const DeviceInfo& info : found)
+        devices.push_back(info.device);
+    return devices;
+}
+
+std::vector<cl_device_id> splitDevice(cl_device_id device, unsigned count) {
+    std::vector<cl_device_id> subDevices;
+
+    cl_uint computeUnits;
+    cl_uint maxSubDevices;
+    clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(computeUnits), &computeUnits, NULL);
+    if (clGetDeviceInfo(device, CL_DEVICE_PARTITION_MAX_SUB_DEVICES, sizeof(maxSubDevices), &maxSubDevices, NULL) != CL_SUCCESS)
+        return subDevices;
+    count = std::min(count, std::min(maxSubDevices, computeUnits));
+    if (count < 2)
+        return subDevices;
+
+    // Exactly count sub-devices with an equal share of the compute units each
+    std::vector<cl_device_partition_property> properties(1, CL_DEVICE_PARTITION_BY_COUNTS);
+    properties.insert(properties.end(), count, static_cast<cl_device_partition_property>(computeUnits / count));
+    properties.push_back(CL_DEVICE_PARTITION_BY_COUNTS_LIST_END);
+    properties.push_back(0);
+    subDevices.resize(count);
+    cl_uint created;
+    if (clCreateSubDevices(device, properties.data(), count, subDevices.data(), &created) != CL_SUCCESS) {
+        subDevices.clear();
+        return subDevices;
+    }
+    subDevices.resize(created);
+    return subDevices;
+}
+
+void setBinaryCacheDir(const std::string& dir) {
+    binaryCacheDir = dir;
+}
+
+// 64-bit FNV-1a
+static uint64_t hashString(const std::string& text) {
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : text) {
+        hash ^= c;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static std::string hexString(uint64_t value) {
+    char text[17];
+    std::snprintf(text, sizeof(text), "%016llx", static_cast<unsigned long long>(value));
+    return text;
+}
+
+// Print the build log of a failed build
+static void printBuildLog(cl_program program, cl_device_id device) {
+    size_t logSize = 0;
+    clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &logSize);
+    std::string log(logSize, '\0');
+    clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, logSize, &log[0], NULL);
+    std::cerr << "Failed to build kernel program (" << deviceString(device, CL_DEVICE_NAME) << "):" << std::endl
+              << log.c_str() << std::endl;
+}
+
+// Cached binaries are stored as the full key, a NUL and the binary. The file name is
+// the hash of the key; the stored key guards against collisions.
+static cl_program loadCachedProgram(cl_context context, cl_device_id device, const std::string& path,
+                                    const std::string& key, const std::string& options) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open())
+        return NULL;
+    std::string contents((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    if (contents.size() <= key.size() + 1 || contents.compare(0, key.size(), key) != 0 || contents[key.size()] != '\0')
+        return NULL;
+
+    const unsigned char* binary = reinterpret_cast<const unsigned char*>(contents.data()) + key.size() + 1;
+    size_t binarySize = contents.size() - key.size() - 1;
+    cl_int binaryStatus, result;
+    cl_program program = clCreateProgramWithBinary(context, 1, &device, &binarySize, &binary, &binaryStatus, &result);
+    if (result != CL_SUCCESS || binaryStatus != CL_SUCCESS) {
+        if (program != NULL)
+            clReleaseProgram(program);
+        return NULL;
+    }
+
+    // Binaries still need a (cheap) build before kernels can be created
+    if (clBuildProgram(program, 1, &device, options.c_str(), NULL, NULL) != CL_SUCCESS) {
+        clReleaseProgram(program);
+        return NULL;
+    }
+    return program;
+}
+
+static void storeCachedProgram(cl_program program, const std::string& path, const std::string& key) {
+    size_t binarySize = 0;
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &binarySize, NULL) != CL_SUCCESS || binarySize == 0)
+        return;
+    std::string binary(binarySize, '\0');
+    unsigned char* binaries[] = {reinterpret_cast<unsigned char*>(&binary[0])};
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(binaries), binaries, NULL) != CL_SUCCESS)
+        return;
+
+    // Write to a temporary file and rename it, so concurrent runs never read half a file
+    std::error_code error;
+    std::filesystem::create_directories(binaryCacheDir, error);
+    std::string temporary = path + ".tmp" + std::to_string(std::random_device()());
+    {
+        std::ofstream file(temporary, std::ios::binary);
+        if (!file.is_open())
+            return;
+        file.write(key.data(), key.size());
+        file.put('\0');
+        file.write(binary.data(), binary.size());
+        if (!file)
+            return;
+    }
+    std::filesystem::rename(temporary, path, error);
+    if (error)
+        std::filesystem::remove(temporary, error);
+}
+
+cl_program buildProgram(cl_context context, cl_device_id device, const std::string& source, const std::string& options,
+                        bool* fromCache) {
+    if (fromCache)
+        *fromCache = false;
+
+    // The binary depends on the device, its driver, the source and the build options
+    std::string key = deviceString(device, CL_DEVICE_NAME) + '\n' + deviceString(device, CL_DRIVER_VERSION) + '\n' +
+                      hexString(hashString(source)) + '\n' + options;
+    std::string path = binaryCacheDir + "/" + hexString(hashString(key)) + ".bin";
+    if (!binaryCacheDir.empty()) {
+        cl_program program = loadCachedProgram(context, device, path, key, options);
+        if (program != NULL) {
+            if (fromCache)
+                *fromCache = true;
+            return program;
+        }
+    }
+
+    const char* kernelSource = source.c_str();
+    size_t sourceSize = source.size();
+    cl_program program = clCreateProgramWithSource(context, 1, &kernelSource, &sourceSize, NULL);
+    if (clBuildProgram(program, 1, &device, options.c_str(), NULL, NULL) != CL_SUCCESS) {
+        printBuildLog(program, device);
+        clReleaseProgram(program);
+        return NULL;
+    }
+
+    if (!binaryCacheDir.empty())
+        storeCachedProgram(program, path, key);
+    return program;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+// Define the target OpenCL version
+#define CL_TARGET_OPENCL_VERSION 300
+
+#include <ostream>
+#include <string>
+#include <vector>
+#include <CL/cl.h>
+
+// Description of one OpenCL device
+struct DeviceInfo {
+    cl_platform_id platform;
+    cl_device_id device;
+    std::string platformName;
+    std::string name;
+    std::string vendor;
+    cl_device_type type;
+    cl_uint computeUnits;
+    size_t maxWorkGroupSize;
+    cl_ulong maxMemAllocSize;
+};
+
+// Load kernel source from file
+bool loadKernelSource(const char* path, std::string& source);
+
+// Every device of every platform
+std::vector<DeviceInfo> listDevices();
+
+// Print one line per device, prefixed with its index
+void printDevices(const std::vector<DeviceInfo>& devices, std::ostream& out);
+
+// Devices matching a selector, in order of preference:
+//   ""                        GPUs first, then every other device
+//   "gpu", "cpu", "accelerator", "all"
+//   "name:TEXT", "vendor:TEXT" substring of the device name or vendor
+//   "N"                       the N-th device of listDevices()
+//   anything else             substring of the name or the vendor
+// Matching is case-insensitive.
+std::vector<DeviceInfo> findDevices(const std::vector<DeviceInfo>& devices, const std::string& selector);
+
+// First device matching the selector (see findDevices)
+bool pickDevice(cl_platform_id& platform, cl_device_id& device, const std::string& selector = "");
+
+// Devices for the multi-device mode: every device matching the selector or, when
+// subDevices > 1, that many sub-devices of the first match (of the first CPU when the
+// selector is empty). Release them with clReleaseDevice (a no-op for devices that are
+// not sub-devices). Prints why when the list is empty.
+std::vector<cl_device_id> pickDevices(const std::string& selector, unsigned subDevices);
+
+// Partition a device (typically a CPU) into count sub-devices of equal size with clCreateSubDevices.
+// Returns an empty list when the device cannot be split. The sub-devices must be
+// released with clReleaseDevice.
+std::vector<cl_device_id> splitDevice(cl_device_id device, unsigned count);
+
+// Create and build an OpenCL program from source with the given clBuildProgram options.
+// Built binaries are cached on disk, keyed by device name, driver version, source hash
+// and options, and later builds with the same key load the binary instead of compiling.
+// Returns NULL when the build fails, after printing the build log; fromCache tells
+// whether the program came from the cache.
+cl_program buildProgram(cl_context context, cl_device_id device, const std::string& source, const std::string& options = "",
+                        bool* fromCache = nullptr);
+
+// Directory of the program binary cache (default ".boid_cache"); empty disables it
+void setBinaryCacheDir(const std::string& dir);
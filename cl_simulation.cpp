@@ -0,0 +1,473 @@
+#include "cl_simulation.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include "population.hpp"
+
+// Digit width of the spatial sort (RADIX_BITS in boid.cl), and the number of pairs each
+// work-item of its histogram and scatter stages walks through
+static const int sortRadixBits = 4;
+static const int sortChunk = 128;
+// Work-groups of checksum_boids, each writes one partial sum
+static const size_t checksumGroups = 64;
+
+ClSimulation::ClSimulation(cl_context context, cl_device_id device, cl_command_queue queue, cl_program program,
+                           const SimParams& params, int numBoids, ClKernel variant, size_t workGroupSize)
+    : device(device), queue(queue), params(params), numBoids(numBoids), variant(variant), workGroupSize(workGroupSize),
+      deterministic(params.deterministic), populations(params.populations()) {
+    if (variant == ClKernel::Auto)
+        this->variant = (numBoids <= TILED_MAX_BOIDS && !populations) ? ClKernel::Tiled : ClKernel::Grid;
+
+    // The deterministic mode never leaves the local size to the runtime
+    if (deterministic && workGroupSize == 0) {
+        size_t deviceMaxSize;
+        clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &deviceMaxSize, NULL);
+        this->workGroupSize = std::min(DETERMINISTIC_WORK_GROUP, deviceMaxSize);
+    }
+
+    // Create double-buffered (ping-pong) boid state
+    boidBuffers[0] = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(Boid) * numBoids, NULL, NULL);
+    boidBuffers[1] = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(Boid) * numBoids, NULL, NULL);
+
+    // Create buffers for the uniform grid
+    cellSize = params.cellSize();
+    gridW = static_cast<int>(std::ceil(params.width / cellSize));
+    gridH = static_cast<int>(std::ceil(params.height / cellSize));
+    numCells = gridW * gridH;
+    sortedBuffer = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(Boid) * numBoids, NULL, NULL);
+    boidCellBuffer = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_int) * numBoids, NULL, NULL);
+    boidRankBuffer = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_int) * numBoids, NULL, NULL);
+    cellCountBuffer = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_int) * numCells, NULL, NULL);
+    cellStartBuffer = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_int) * (numCells + 1), NULL, NULL);
+
+    // Create buffers for the spatial sort. Keys interleave the bits of both cell
+    // coordinates, so only as many digits as the largest coordinate needs are sorted
+    int coordinateBits = 1;
+    while ((1 << coordinateBits) < std::max(gridW, gridH))
+        ++coordinateBits;
+    sortPasses = (2 * coordinateBits + sortRadixBits - 1) / sortRadixBits;
+    sortChunks = (numBoids + sortChunk - 1) / sortChunk;
+    int histogramSize = sortChunks << sortRadixBits;
+    for (int i = 0; i < 2; ++i) {
+        sortKeyBuffers[i] = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint) * numBoids, NULL, NULL);
+        permutationBuffers[i] = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_int) * numBoids, NULL, NULL);
+        idBuffers[i] = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_int) * numBoids, NULL, NULL);
+    }
+    histogramBuffer = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_int) * histogramSize, NULL, NULL);
+    histogramStartBuffer = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_int) * (histogramSize + 1), NULL, NULL);
+
+    // Create the population buffers; without populations the kernels get NULL for them
+    speciesBuffers[0] = speciesBuffers[1] = NULL;
+    sortedSpeciesBuffer = speciesRulesBuffer = fieldBuffer = NULL;
+    if (populations) {
+        for (int i = 0; i < 2; ++i)
+            speciesBuffers[i] = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_uchar) * numBoids, NULL, NULL);
+        sortedSpeciesBuffer = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_uchar) * numBoids, NULL, NULL);
+        std::vector<float> rules = speciesRuleTable(params);
+        speciesRulesBuffer = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(float) * rules.size(),
+                                            rules.data(), NULL);
+        std::vector<float> field = buildField(params, fieldW, fieldH);
+        fieldBuffer = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(float) * field.size(),
+                                     field.data(), NULL);
+    }
+
+    // Create the buffer for the partial checksums
+    checksumBuffer = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_long) * 4 * checksumGroups, NULL, NULL);
+
+    createKernels(program);
+    setSortInterval(SORT_AUTO);
+
+    // Launches with a local size above the kernel limit fail, so refuse it up front
+    size_t maxSize = maxWorkGroupSize();
+    if (this->workGroupSize > maxSize) {
+        std::cerr << "Work-group size " << this->workGroupSize << " is larger than the " << maxSize
+                  << " the " << name() << " kernels allow on this device." << std::endl;
+        workGroupAccepted = false;
+    }
+}
+
+ClSimulation::~ClSimulation() {
+    releaseKernels();
+    clReleaseMemObject(boidBuffers[0]);
+    clReleaseMemObject(boidBuffers[1]);
+    clReleaseMemObject(sortedBuffer);
+    clReleaseMemObject(boidCellBuffer);
+    clReleaseMemObject(boidRankBuffer);
+    clReleaseMemObject(cellCountBuffer);
+    clReleaseMemObject(cellStartBuffer);
+    for (int i = 0; i < 2; ++i) {
+        clReleaseMemObject(sortKeyBuffers[i]);
+        clReleaseMemObject(permutationBuffers[i]);
+        clReleaseMemObject(idBuffers[i]);
+    }
+    clReleaseMemObject(histogramBuffer);
+    clReleaseMemObject(histogramStartBuffer);
+    clReleaseMemObject(checksumBuffer);
+    if (populations) {
+        clReleaseMemObject(speciesBuffers[0]);
+        clReleaseMemObject(speciesBuffers[1]);
+        clReleaseMemObject(sortedSpeciesBuffer);
+        clReleaseMemObject(speciesRulesBuffer);
+        clReleaseMemObject(fieldBuffer);
+    }
+}
+
+void ClSimulation::setSortInterval(int steps) {
+    sortRequest = steps;
+    if (variant != ClKernel::Grid) {
+        sortEvery = 0;
+    } else if (deterministic) {
+        // Ranks in memory order need the boids of every cell next to each other
+        sortEvery = 1;
+    } else if (steps == SORT_AUTO) {
+        // Steps a boid at full speed takes to cross a cell
+        sortEvery = std::max(1, static_cast<int>(std::ceil(cellSize / (params.maxSpeed * params.dt))));
+    } else {
+        sortEvery = std::max(0, steps);
+    }
+}
+
+void ClSimulation::setProgram(cl_program program, const SimParams& params) {
+    this->params = params;
+
+    // Steps already enqueued keep the kernels they were launched with
+    releaseKernels();
+    createKernels(program);
+    setSortInterval(sortRequest);
+}
+
+void ClSimulation::createKernels(cl_program program) {
+    // Create kernel
+    kernel = clCreateKernel(program, "update_boids", NULL);
+
+    // Set kernel arguments (the input/output boid buffers are set every step)
+    clSetKernelArg(kernel, 2, sizeof(int), &numBoids);
+    clSetKernelArg(kernel, 3, sizeof(float), &params.dt);
+    clSetKernelArg(kernel, 4, sizeof(float), &params.width);
+    clSetKernelArg(kernel, 5, sizeof(float), &params.height);
+
+    // Create the tiled kernel, one tile per work-group
+    tiledKernel = clCreateKernel(program, "update_boids_tiled", NULL);
+    size_t deviceMaxSize, kernelMaxSize;
+    clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &deviceMaxSize, NULL);
+    clGetKernelWorkGroupInfo(tiledKernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &kernelMaxSize, NULL);
+    tileSize = std::min(deviceMaxSize, kernelMaxSize);
+    tileSize = (workGroupSize > 0) ? std::min(workGroupSize, tileSize) : std::min<size_t>(tileSize, 256);
+    clSetKernelArg(tiledKernel, 2, sizeof(int), &numBoids);
+    clSetKernelArg(tiledKernel, 3, sizeof(float), &params.dt);
+    clSetKernelArg(tiledKernel, 4, sizeof(float), &params.width);
+    clSetKernelArg(tiledKernel, 5, sizeof(float), &params.height);
+    clSetKernelArg(tiledKernel, 6, sizeof(cl_float4) * tileSize, NULL);
+
+    // Create grid pipeline kernels
+    resetCellsKernel = clCreateKernel(program, "reset_cells", NULL);
+    countCellsKernel = clCreateKernel(program, "count_cells", NULL);
+    scanCellsKernel = clCreateKernel(program, "scan_cells", NULL);
+    scatterBoidsKernel = clCreateKernel(program, "scatter_boids", NULL);
+    gridKernel = clCreateKernel(program, "update_boids_grid", NULL);
+
+    // Set grid pipeline kernel arguments
+    clSetKernelArg(resetCellsKernel, 0, sizeof(cl_mem), &cellCountBuffer);
+    clSetKernelArg(resetCellsKernel, 1, sizeof(int), &numCells);
+
+    clSetKernelArg(countCellsKernel, 1, sizeof(cl_mem), &boidCellBuffer);
+    clSetKernelArg(countCellsKernel, 2, sizeof(cl_mem), &boidRankBuffer);
+    clSetKernelArg(countCellsKernel, 3, sizeof(cl_mem), &cellCountBuffer);
+    clSetKernelArg(countCellsKernel, 4, sizeof(int), &numBoids);
+    clSetKernelArg(countCellsKernel, 5, sizeof(float), &cellSize);
+    clSetKernelArg(countCellsKernel, 6, sizeof(int), &gridW);
+    clSetKernelArg(countCellsKernel, 7, sizeof(int), &gridH);
+    // The grid covers the whole world
+    int firstRow = 0;
+    clSetKernelArg(countCellsKernel, 8, sizeof(int), &firstRow);
+
+    // The scan runs as a single work-group, as large as the device allows (up to 256)
+    clGetKernelWorkGroupInfo(scanCellsKernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &scanGroupSize, NULL);
+    scanGroupSize = std::min<size_t>(scanGroupSize, 256);
+    clSetKernelArg(scanCellsKernel, 0, sizeof(cl_mem), &cellCountBuffer);
+    clSetKernelArg(scanCellsKernel, 1, sizeof(cl_mem), &cellStartBuffer);
+    clSetKernelArg(scanCellsKernel, 2, sizeof(int), &numCells);
+    clSetKernelArg(scanCellsKernel, 3, sizeof(cl_int) * scanGroupSize, NULL);
+
+    clSetKernelArg(scatterBoidsKernel, 1, sizeof(cl_mem), &boidCellBuffer);
+    clSetKernelArg(scatterBoidsKernel, 2, sizeof(cl_mem), &boidRankBuffer);
+    clSetKernelArg(scatterBoidsKernel, 3, sizeof(cl_mem), &cellStartBuffer);
+    clSetKernelArg(scatterBoidsKernel, 4, sizeof(cl_mem), &sortedBuffer);
+    clSetKernelArg(scatterBoidsKernel, 5, sizeof(int), &numBoids);
+    clSetKernelArg(scatterBoidsKernel, 7, sizeof(cl_mem), &sortedSpeciesBuffer);
+
+    clSetKernelArg(gridKernel, 0, sizeof(cl_mem), &sortedBuffer);
+    clSetKernelArg(gridKernel, 1, sizeof(cl_mem), &boidCellBuffer);
+    clSetKernelArg(gridKernel, 2, sizeof(cl_mem), &boidRankBuffer);
+    clSetKernelArg(gridKernel, 3, sizeof(cl_mem), &cellStartBuffer);
+    clSetKernelArg(gridKernel, 5, sizeof(int), &numBoids);
+    clSetKernelArg(gridKernel, 6, sizeof(float), &params.dt);
+    clSetKernelArg(gridKernel, 7, sizeof(float), &params.width);
+    clSetKernelArg(gridKernel, 8, sizeof(float), &params.height);
+    clSetKernelArg(gridKernel, 9, sizeof(float), &cellSize);
+    clSetKernelArg(gridKernel, 10, sizeof(int), &gridW);
+    clSetKernelArg(gridKernel, 11, sizeof(int), &gridH);
+    clSetKernelArg(gridKernel, 12, sizeof(cl_mem), &sortedSpeciesBuffer);
+    clSetKernelArg(gridKernel, 13, sizeof(cl_mem), &speciesRulesBuffer);
+    clSetKernelArg(gridKernel, 14, sizeof(cl_mem), &fieldBuffer);
+    clSetKernelArg(gridKernel, 15, sizeof(int), &fieldW);
+    clSetKernelArg(gridKernel, 16, sizeof(int), &fieldH);
+    clSetKernelArg(gridKernel, 17, sizeof(float), &FIELD_CELL);
+
+    // Create spatial sort kernels. The key and permutation buffers of a pass and the
+    // buffers of permute_boids are set for every sort
+    mortonKeysKernel = clCreateKernel(program, "morton_keys", NULL);
+    radixHistogramKernel = clCreateKernel(program, "radix_histogram", NULL);
+    scanHistogramKernel = clCreateKernel(program, "scan_cells", NULL);
+    radixScatterKernel = clCreateKernel(program, "radix_scatter", NULL);
+    permuteBoidsKernel = clCreateKernel(program, "permute_boids", NULL);
+
+    // Set spatial sort kernel arguments
+    clSetKernelArg(mortonKeysKernel, 1, sizeof(cl_mem), &sortKeyBuffers[0]);
+    clSetKernelArg(mortonKeysKernel, 2, sizeof(cl_mem), &permutationBuffers[0]);
+    clSetKernelArg(mortonKeysKernel, 3, sizeof(int), &numBoids);
+    clSetKernelArg(mortonKeysKernel, 4, sizeof(float), &cellSize);
+    clSetKernelArg(mortonKeysKernel, 5, sizeof(int), &gridW);
+    clSetKernelArg(mortonKeysKernel, 6, sizeof(int), &gridH);
+
+    clSetKernelArg(radixHistogramKernel, 1, sizeof(cl_mem), &histogramBuffer);
+    clSetKernelArg(radixHistogramKernel, 2, sizeof(int), &numBoids);
+    clSetKernelArg(radixHistogramKernel, 4, sizeof(int), &sortChunk);
+    clSetKernelArg(radixHistogramKernel, 5, sizeof(int), &sortChunks);
+
+    int histogramSize = sortChunks << sortRadixBits;
+    clSetKernelArg(scanHistogramKernel, 0, sizeof(cl_mem), &histogramBuffer);
+    clSetKernelArg(scanHistogramKernel, 1, sizeof(cl_mem), &histogramStartBuffer);
+    clSetKernelArg(scanHistogramKernel, 2, sizeof(int), &histogramSize);
+    clSetKernelArg(scanHistogramKernel, 3, sizeof(cl_int) * scanGroupSize, NULL);
+
+    clSetKernelArg(radixScatterKernel, 4, sizeof(cl_mem), &histogramStartBuffer);
+    clSetKernelArg(radixScatterKernel, 5, sizeof(int), &numBoids);
+    clSetKernelArg(radixScatterKernel, 7, sizeof(int), &sortChunk);
+    clSetKernelArg(radixScatterKernel, 8, sizeof(int), &sortChunks);
+
+    clSetKernelArg(permuteBoidsKernel, 1, sizeof(cl_mem), &permutationBuffers[sortPasses % 2]);
+    clSetKernelArg(permuteBoidsKernel, 3, sizeof(int), &numBoids);
+
+    unpermuteBoidsKernel = clCreateKernel(program, "unpermute_boids", NULL);
+    clSetKernelArg(unpermuteBoidsKernel, 2, sizeof(cl_mem), &sortedBuffer);
+    clSetKernelArg(unpermuteBoidsKernel, 3, sizeof(int), &numBoids);
+
+    // Create the deterministic ranking and checksum kernels
+    rankCellsKernel = clCreateKernel(program, "rank_sorted_cells", NULL);
+    clSetKernelArg(rankCellsKernel, 0, sizeof(cl_mem), &boidCellBuffer);
+    clSetKernelArg(rankCellsKernel, 1, sizeof(cl_mem), &boidRankBuffer);
+    clSetKernelArg(rankCellsKernel, 2, sizeof(int), &numBoids);
+
+    // The checksum reduction needs a power of two local size, up to 256
+    checksumKernel = clCreateKernel(program, "checksum_boids", NULL);
+    size_t checksumMaxSize;
+    clGetKernelWorkGroupInfo(checksumKernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &checksumMaxSize, NULL);
+    checksumMaxSize = std::min<size_t>(checksumMaxSize, 256);
+    checksumGroupSize = 1;
+    while (checksumGroupSize * 2 <= checksumMaxSize)
+        checksumGroupSize *= 2;
+    clSetKernelArg(checksumKernel, 1, sizeof(cl_mem), &checksumBuffer);
+    clSetKernelArg(checksumKernel, 2, sizeof(int), &numBoids);
+    clSetKernelArg(checksumKernel, 3, sizeof(cl_long) * 4 * checksumGroupSize, NULL);
+}
+
+void ClSimulation::releaseKernels() {
+    clReleaseKernel(kernel);
+    clReleaseKernel(tiledKernel);
+    clReleaseKernel(resetCellsKernel);
+    clReleaseKernel(countCellsKernel);
+    clReleaseKernel(scanCellsKernel);
+    clReleaseKernel(scatterBoidsKernel);
+    clReleaseKernel(gridKernel);
+    clReleaseKernel(mortonKeysKernel);
+    clReleaseKernel(radixHistogramKernel);
+    clReleaseKernel(scanHistogramKernel);
+    clReleaseKernel(radixScatterKernel);
+    clReleaseKernel(permuteBoidsKernel);
+    clReleaseKernel(unpermuteBoidsKernel);
+    clReleaseKernel(rankCellsKernel);
+    clReleaseKernel(checksumKernel);
+}
+
+const char* ClSimulation::name() const {
+    switch (variant) {
+    case ClKernel::BruteForce:
+        return "opencl-brute-force";
+    case ClKernel::Tiled:
+        return "opencl-tiled";
+    default:
+        return populations ? "opencl-grid-populations" : "opencl-grid";
+    }
+}
+
+void ClSimulation::upload(const Boid* boids, cl_event* event) {
+    // A new state is in upload order with the initial species, and is sorted again by
+    // the next step
+    stepCount = 0;
+    orderCurrent = 0;
+    sorted = false;
+    std::vector<cl_int> ids(numBoids);
+    for (int i = 0; i < numBoids; ++i)
+        ids[i] = i;
+    clEnqueueWriteBuffer(queue, idBuffers[0], CL_TRUE, 0, sizeof(cl_int) * numBoids, ids.data(), 0, NULL, NULL);
+    if (populations) {
+        std::vector<uint8_t> species = assignSpecies(params, numBoids);
+        clEnqueueWriteBuffer(queue, speciesBuffers[0], CL_TRUE, 0, sizeof(cl_uchar) * numBoids, species.data(), 0, NULL, NULL);
+    }
+    clEnqueueWriteBuffer(queue, boidBuffers[current], CL_TRUE, 0, sizeof(Boid) * numBoids, boids, 0, NULL, event);
+}
+
+cl_mem ClSimulation::orderedState() {
+    if (!sorted)
+        return boidBuffers[current];
+
+    // The cell-sorted buffer is scratch between steps
+    clSetKernelArg(unpermuteBoidsKernel, 0, sizeof(cl_mem), &boidBuffers[current]);
+    clSetKernelArg(unpermuteBoidsKernel, 1, sizeof(cl_mem), &idBuffers[orderCurrent]);
+    enqueue(unpermuteBoidsKernel, numBoids, nullptr);
+    return sortedBuffer;
+}
+
+void ClSimulation::download(Boid* boids) {
+    clEnqueueReadBuffer(queue, orderedState(), CL_TRUE, 0, sizeof(Boid) * numBoids, boids, 0, NULL, NULL);
+}
+
+BoidChecksum ClSimulation::checksum() {
+    clSetKernelArg(checksumKernel, 0, sizeof(cl_mem), &boidBuffers[current]);
+    size_t globalSize = checksumGroups * checksumGroupSize;
+    clEnqueueNDRangeKernel(queue, checksumKernel, 1, NULL, &globalSize, &checksumGroupSize, 0, NULL, NULL);
+
+    // Add up the partial sums of the work-groups
+    std::vector<cl_long> partials(4 * checksumGroups);
+    clEnqueueReadBuffer(queue, checksumBuffer, CL_TRUE, 0, sizeof(cl_long) * partials.size(), partials.data(), 0, NULL, NULL);
+    BoidChecksum checksum;
+    for (size_t group = 0; group < checksumGroups; ++group) {
+        checksum.x += partials[4 * group];
+        checksum.y += partials[4 * group + 1];
+        checksum.vx += partials[4 * group + 2];
+        checksum.vy += partials[4 * group + 3];
+    }
+    return checksum;
+}
+
+size_t ClSimulation::maxWorkGroupSize() const {
+    // The tiled kernel picks a tile size it accepts, and only the grid sorts. A kernel
+    // limit never exceeds the device limit
+    std::vector<cl_kernel> launched;
+    if (variant == ClKernel::BruteForce) {
+        launched = {kernel};
+    } else if (variant == ClKernel::Grid) {
+        launched = {resetCellsKernel, countCellsKernel, scatterBoidsKernel, gridKernel, mortonKeysKernel,
+                    radixHistogramKernel, radixScatterKernel, permuteBoidsKernel, unpermuteBoidsKernel};
+        if (deterministic)
+            launched.push_back(rankCellsKernel);
+    }
+
+    size_t maxSize = SIZE_MAX;
+    for (cl_kernel launchedKernel : launched) {
+        size_t kernelMaxSize;
+        clGetKernelWorkGroupInfo(launchedKernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &kernelMaxSize, NULL);
+        maxSize = std::min(maxSize, kernelMaxSize);
+    }
+    return maxSize;
+}
+
+void ClSimulation::enqueue(cl_kernel launched, size_t globalSize, std::vector<cl_event>* events) {
+    const size_t* localSize = NULL;
+    if (workGroupSize > 0) {
+        globalSize = (globalSize + workGroupSize - 1) / workGroupSize * workGroupSize;
+        localSize = &workGroupSize;
+    }
+
+    cl_event event;
+    clEnqueueNDRangeKernel(queue, launched, 1, NULL, &globalSize, localSize, 0, NULL, events ? &event : NULL);
+    if (events)
+        events->push_back(event);
+}
+
+void ClSimulation::sort(std::vector<cl_event>* events) {
+    // Keys of the current state and the identity permutation
+    clSetKernelArg(mortonKeysKernel, 0, sizeof(cl_mem), &boidBuffers[current]);
+    enqueue(mortonKeysKernel, numBoids, events);
+
+    // One stable pass per digit, ping-ponging between the two key/permutation pairs
+    for (int pass = 0; pass < sortPasses; ++pass) {
+        int shift = pass * sortRadixBits;
+        int in = pass % 2;
+        clSetKernelArg(radixHistogramKernel, 0, sizeof(cl_mem), &sortKeyBuffers[in]);
+        clSetKernelArg(radixHistogramKernel, 3, sizeof(int), &shift);
+        enqueue(radixHistogramKernel, sortChunks, events);
+
+        cl_event event;
+        clEnqueueNDRangeKernel(queue, scanHistogramKernel, 1, NULL, &scanGroupSize, &scanGroupSize, 0, NULL, events ? &event : NULL);
+        if (events)
+            events->push_back(event);
+
+        clSetKernelArg(radixScatterKernel, 0, sizeof(cl_mem), &sortKeyBuffers[in]);
+        clSetKernelArg(radixScatterKernel, 1, sizeof(cl_mem), &permutationBuffers[in]);
+        clSetKernelArg(radixScatterKernel, 2, sizeof(cl_mem), &sortKeyBuffers[1 - in]);
+        clSetKernelArg(radixScatterKernel, 3, sizeof(cl_mem), &permutationBuffers[1 - in]);
+        clSetKernelArg(radixScatterKernel, 6, sizeof(int), &shift);
+        enqueue(radixScatterKernel, sortChunks, events);
+    }
+
+    // Gather the state into the other ping-pong buffer
+    clSetKernelArg(permuteBoidsKernel, 0, sizeof(cl_mem), &boidBuffers[current]);
+    clSetKernelArg(permuteBoidsKernel, 2, sizeof(cl_mem), &boidBuffers[1 - current]);
+    clSetKernelArg(permuteBoidsKernel, 4, sizeof(cl_mem), &speciesBuffers[orderCurrent]);
+    clSetKernelArg(permuteBoidsKernel, 5, sizeof(cl_mem), &speciesBuffers[1 - orderCurrent]);
+    clSetKernelArg(permuteBoidsKernel, 6, sizeof(cl_mem), &idBuffers[orderCurrent]);
+    clSetKernelArg(permuteBoidsKernel, 7, sizeof(cl_mem), &idBuffers[1 - orderCurrent]);
+    enqueue(permuteBoidsKernel, numBoids, events);
+    current = 1 - current;
+    orderCurrent = 1 - orderCurrent;
+    sorted = true;
+}
+
+void ClSimulation::step(std::vector<cl_event>* events) {
+    // Restore memory locality before it has decayed much
+    if (sortEvery > 0 && stepCount++ % sortEvery == 0)
+        sort(events);
+
+    cl_mem input = boidBuffers[current];
+    cl_mem output = boidBuffers[1 - current];
+    if (variant == ClKernel::BruteForce) {
+        clSetKernelArg(kernel, 0, sizeof(cl_mem), &input);
+        clSetKernelArg(kernel, 1, sizeof(cl_mem), &output);
+        enqueue(kernel, numBoids, events);
+    } else if (variant == ClKernel::Tiled) {
+        // The global size is padded to whole tiles
+        clSetKernelArg(tiledKernel, 0, sizeof(cl_mem), &input);
+        clSetKernelArg(tiledKernel, 1, sizeof(cl_mem), &output);
+        size_t globalSize = (numBoids + tileSize - 1) / tileSize * tileSize;
+        cl_event event;
+        clEnqueueNDRangeKernel(queue, tiledKernel, 1, NULL, &globalSize, &tileSize, 0, NULL, events ? &event : NULL);
+        if (events)
+            events->push_back(event);
+    } else {
+        // Bin boids into cells, then only visit the 3x3 neighborhood
+        clSetKernelArg(countCellsKernel, 0, sizeof(cl_mem), &input);
+        clSetKernelArg(scatterBoidsKernel, 0, sizeof(cl_mem), &input);
+        clSetKernelArg(scatterBoidsKernel, 6, sizeof(cl_mem), &speciesBuffers[orderCurrent]);
+        clSetKernelArg(gridKernel, 4, sizeof(cl_mem), &output);
+        enqueue(resetCellsKernel, numCells, events);
+        enqueue(countCellsKernel, numBoids, events);
+        if (deterministic)
+            enqueue(rankCellsKernel, numBoids, events);
+
+        // The scan is always exactly one work-group
+        cl_event event;
+        clEnqueueNDRangeKernel(queue, scanCellsKernel, 1, NULL, &scanGroupSize, &scanGroupSize, 0, NULL, events ? &event : NULL);
+        if (events)
+            events->push_back(event);
+
+        enqueue(scatterBoidsKernel, numBoids, events);
+        enqueue(gridKernel, numBoids, events);
+    }
+
+    // The output of this step is the input of the next one
+    current = 1 - current;
+}
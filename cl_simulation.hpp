@@ -0,0 +1,178 @@
+#pragma once
+
+// Define the target OpenCL version
+#define CL_TARGET_OPENCL_VERSION 300
+
+#include <vector>
+#include <CL/cl.h>
+#include "boid.hpp"
+#include "params.hpp"
+#include "simulation.hpp"
+
+// Neighbor search run by every step
+enum class ClKernel {
+    Auto,       // Tiled below TILED_MAX_BOIDS boids, Grid from there on
+    Grid,       // Uniform grid pipeline
+    BruteForce, // update_boids, every neighbor read from global memory
+    Tiled       // update_boids_tiled, neighbors staged through local memory
+};
+
+// Largest flock Auto runs with the tiled kernel. This is a placeholder, not a measured
+// value: no sweep has been recorded for it yet. Replace it with the crossover that
+// `--headless --sweep` prints on the target devices.
+const int TILED_MAX_BOIDS = 4096;
+
+// Sort interval picked from the flocking rules (see ClSimulation::setSortInterval)
+const int SORT_AUTO = -1;
+
+// Work-group size of the deterministic mode when none is given
+const size_t DETERMINISTIC_WORK_GROUP = 64;
+
+// Boid simulation running on an OpenCL device.
+//
+// The state is double-buffered (ping-pong) and stays resident on the device: every
+// step reads one buffer and writes the other, and the two are swapped afterwards.
+// A step runs the uniform grid pipeline from boid.cl, or one of the O(N^2) kernels.
+// With the grid, the boids are also reordered by cell every few steps, so that boids
+// close in space stay close in memory. The state buffer is therefore not kept in upload
+// order; the upload index of every boid moves along with it, and download() and
+// orderedState() put the boids back in upload order.
+//
+// With params.deterministic, the same program, device and initial state always give the
+// same trajectory: the grid sorts the boids by cell before every step and ranks them in
+// memory order instead of with atomics, so every boid sums its neighbors in a fixed
+// order (the O(N^2) kernels always do). Every launch uses an explicit local size.
+//
+// With params.populations(), the grid also keeps the species of every boid on the device
+// (reset to assignSpecies by every upload) and runs species, predators and the steering
+// field in its update kernel; Auto then always picks the grid, and the O(N^2) kernels
+// ignore them.
+class ClSimulation : public Simulation {
+public:
+    // program must be built with kernelBuildOptions(params); params.boids is ignored in
+    // favour of numBoids. workGroupSize 0 leaves the local size to the runtime, otherwise
+    // the global size is padded up to a multiple of it; the deterministic mode uses
+    // DETERMINISTIC_WORK_GROUP for 0. The tiled kernel always needs a local size: with 0
+    // it uses the largest the device and kernel allow, up to 256. A workGroupSize larger
+    // than the other kernels of the variant allow is rejected, see ready().
+    ClSimulation(cl_context context, cl_device_id device, cl_command_queue queue, cl_program program,
+                 const SimParams& params, int numBoids, ClKernel variant, size_t workGroupSize = 0);
+    ~ClSimulation() override;
+
+    ClSimulation(const ClSimulation&) = delete;
+    ClSimulation& operator=(const ClSimulation&) = delete;
+
+    const char* name() const override;
+    int size() const override { return numBoids; }
+
+    void upload(const Boid* boids) override { upload(boids, nullptr); }
+    void step() override { step(nullptr); }
+    void download(Boid* boids) override;
+
+    // False when the work-group size was rejected; every launch would fail, so the
+    // simulation must not be used
+    bool ready() const { return workGroupAccepted; }
+
+    // Upload a full state (blocking), optionally returning the transfer event
+    void upload(const Boid* boids, cl_event* event);
+
+    // Enqueue one step without waiting for it. When events is given, the event of
+    // every kernel launch is appended to it and owned by the caller.
+    void step(std::vector<cl_event>* events);
+
+    // Buffer holding the latest state, in sorted order once the grid has sorted it
+    cl_mem state() const { return boidBuffers[current]; }
+
+    // Buffer holding the latest state in upload order, gathered into it when the boids
+    // were sorted since the upload. Enqueued without waiting; valid until the next step.
+    cl_mem orderedState();
+
+    // Run the next steps with the kernels of another build of boid.cl, e.g. one with a
+    // different speed limit or rule factors; program must be built with
+    // kernelBuildOptions(params). The state is kept, and a SORT_AUTO interval is picked
+    // again for the new speed limit. The radii must not exceed the cell size the
+    // simulation was created with.
+    void setProgram(cl_program program, const SimParams& params);
+
+    // Sort the boids by the Morton code of their cell before every steps-th step, the
+    // first one included. 0 never sorts; SORT_AUTO (the default) sorts about as often
+    // as a boid at full speed crosses a cell. Only the grid kernel sorts, the O(N^2)
+    // kernels read every boid in order anyway. The deterministic grid always sorts
+    // before every step.
+    void setSortInterval(int steps);
+
+    // Steps between two sorts, 0 when the boids are never sorted
+    int sortInterval() const { return sortEvery; }
+
+    // Permutation of the last sort: slot i now holds the boid that was at permutation[i].
+    // Per-boid data kept outside the state is reordered the same way.
+    cl_mem permutation() const { return permutationBuffers[sortPasses % 2]; }
+
+    // Upload index of the boid in every slot of the state, across every sort so far
+    cl_mem ids() const { return idBuffers[orderCurrent]; }
+
+    // Checksum of the latest state, reduced on the device (blocking)
+    BoidChecksum checksum();
+
+private:
+    void createKernels(cl_program program);
+    void releaseKernels();
+    void enqueue(cl_kernel kernel, size_t globalSize, std::vector<cl_event>* events);
+    // Largest local size every kernel the variant launches through enqueue() accepts,
+    // SIZE_MAX when it launches none
+    size_t maxWorkGroupSize() const;
+    void sort(std::vector<cl_event>* events);
+
+    cl_device_id device;
+    cl_command_queue queue;
+    SimParams params;
+    int numBoids;
+    ClKernel variant;
+    size_t workGroupSize;
+    bool workGroupAccepted = true;
+    bool deterministic;
+
+    // Ping-pong state
+    cl_mem boidBuffers[2];
+    int current = 0;
+
+    // Uniform grid
+    float cellSize;
+    int gridW, gridH, numCells;
+    cl_mem sortedBuffer, boidCellBuffer, boidRankBuffer, cellCountBuffer, cellStartBuffer;
+    size_t scanGroupSize;
+
+    cl_kernel kernel;
+    cl_kernel tiledKernel;
+    size_t tileSize;
+    cl_kernel resetCellsKernel, countCellsKernel, scanCellsKernel, scatterBoidsKernel, gridKernel;
+
+    // Spatial sort: radix sort of (Morton key, index) pairs, one RADIX_BITS digit per pass.
+    // sortRequest is the interval passed to setSortInterval
+    int sortRequest = SORT_AUTO;
+    int sortEvery = 0;
+    long long stepCount = 0;
+    int sortChunks, sortPasses;
+    cl_mem sortKeyBuffers[2], permutationBuffers[2], histogramBuffer, histogramStartBuffer;
+    cl_kernel mortonKeysKernel, radixHistogramKernel, scanHistogramKernel, radixScatterKernel, permuteBoidsKernel;
+
+    // Upload index and species of every boid, ping-ponged by every sort; sorted is set
+    // when the state has left upload order
+    cl_mem idBuffers[2];
+    int orderCurrent = 0;
+    bool sorted = false;
+    cl_kernel unpermuteBoidsKernel;
+    cl_kernel rankCellsKernel;
+
+    // Populations: species of every boid (see idBuffers), and of every slot of the
+    // cell-sorted buffer; the rule table and steering field are constant
+    bool populations;
+    cl_mem speciesBuffers[2];
+    cl_mem sortedSpeciesBuffer, speciesRulesBuffer, fieldBuffer;
+    int fieldW = 0, fieldH = 0;
+
+    // Checksum: partial sums of a fixed number of work-groups
+    cl_mem checksumBuffer;
+    cl_kernel checksumKernel;
+    size_t checksumGroupSize;
+};
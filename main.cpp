@@ -4,82 +4,406 @@
 #define MAX_SOURCE_SIZE (0x100000)
 
 #include <iostream>
-#include <fstream>
 #include <vector>
+#include <cstring>
+#include <algorithm>
+#include <cstdlib>
+#include <string>
+#include <memory>
+#include <future>
+#include <chrono>
+#include <cstdio>
 #include <CL/cl.h>
 #include <cassert>
 #include <SFML/Graphics.hpp>
 #include <SFML/Window/Event.hpp>
+#include "boid.hpp"
+#include "benchmark.hpp"
+#include "cl_setup.hpp"
+#include "cl_simulation.hpp"
+#include "multi_device_simulation.hpp"
+#include "native_simulation.hpp"
+#include "params.hpp"
+#include "program_cache.hpp"
+#include "renderer.hpp"
+#include "trajectory.hpp"
 
-// Define the number of boids
-const int NUM_BOIDS = 5000;
-const float WIDTH = 1920.0f;
-const float HEIGHT = 1080.0f;
-
-
-// Structure to represent a boid
-struct Boid {
-    float x, y, vx, vy;
-};
-
-int main() {
+int main(int argc, char** argv) {
 
     // Declare a boolean variable to track whether the simulation should run or not
     bool runSimulation = false;
 
-    // Load kernel source from file
-    std::ifstream kernelFile("boid.cl");
-    if (!kernelFile.is_open()) {
-        std::cerr << "Failed to open kernel file." << std::endl;
+    // World, number of boids and flocking rules, from --config files and flags
+    SimParams params;
+    // Neighbor search: the uniform grid, one of the O(N^2) kernels, or picked by flock size
+    ClKernel kernel = ClKernel::Auto;
+    // Steps between two spatial sorts of the grid kernel (0 = never)
+    int sortInterval = SORT_AUTO;
+    // Number of simulation steps run on the device for every rendered frame
+    int stepsPerFrame = 1;
+    // Never share buffers with OpenGL, always render from host memory
+    bool noInterop = false;
+    // Simulation backend: OpenCL, or native C++ with this many threads (0 = all)
+    bool native = false;
+    unsigned threads = 0;
+    // OpenCL device selector (see findDevices), and whether to split the world over
+    // every matching device or over this many sub-devices of the first one
+    std::string deviceSelector;
+    bool multiDevice = false;
+    unsigned subDevices = 0;
+    // Headless benchmark settings
+    bool headless = false;
+    bool sweep = false;
+    BenchmarkOptions benchmark;
+    size_t workGroupSize = 0;
+    // Trajectory file to record into every recordInterval steps, or to replay
+    std::string recordPath;
+    int recordInterval = 1;
+    std::string replayPath;
+    // With --deterministic, print the checksum of the state every checksumInterval steps
+    int checksumInterval = 100;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--brute-force") == 0) {
+            kernel = ClKernel::BruteForce;
+        } else if (std::strcmp(argv[i], "--kernel") == 0 && i + 1 < argc) {
+            ++i;
+            if (std::strcmp(argv[i], "auto") == 0) {
+                kernel = ClKernel::Auto;
+            } else if (std::strcmp(argv[i], "grid") == 0) {
+                kernel = ClKernel::Grid;
+            } else if (std::strcmp(argv[i], "brute-force") == 0) {
+                kernel = ClKernel::BruteForce;
+            } else if (std::strcmp(argv[i], "tiled") == 0) {
+                kernel = ClKernel::Tiled;
+            } else {
+                std::cerr << "Unknown kernel: " << argv[i] << std::endl;
+                return 1;
+            }
+        } else if (std::strcmp(argv[i], "--sort-every") == 0 && i + 1 < argc) {
+            ++i;
+            sortInterval = (std::strcmp(argv[i], "auto") == 0) ? SORT_AUTO : std::max(0, std::atoi(argv[i]));
+        } else if (std::strcmp(argv[i], "--boids") == 0 && i + 1 < argc) {
+            params.boids = std::max(1, std::atoi(argv[++i]));
+        } else if (std::strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            if (!setParam(params, "seed", argv[++i])) {
+                std::cerr << "Invalid seed: " << argv[i] << std::endl;
+                return 1;
+            }
+        } else if (std::strcmp(argv[i], "--deterministic") == 0) {
+            params.deterministic = true;
+        } else if (std::strcmp(argv[i], "--config") == 0 && i + 1 < argc) {
+            if (!loadParams(argv[++i], params))
+                return 1;
+        } else if (std::strcmp(argv[i], "--set") == 0 && i + 1 < argc) {
+            std::string assignment = argv[++i];
+            size_t equals = assignment.find('=');
+            if (equals == std::string::npos || !setParam(params, assignment.substr(0, equals), assignment.substr(equals + 1))) {
+                std::cerr << "Invalid parameter: " << assignment << std::endl;
+                return 1;
+            }
+        } else if (std::strcmp(argv[i], "--steps-per-frame") == 0 && i + 1 < argc) {
+            stepsPerFrame = std::max(1, std::atoi(argv[++i]));
+        } else if (std::strcmp(argv[i], "--no-interop") == 0) {
+            noInterop = true;
+        } else if (std::strcmp(argv[i], "--program-cache") == 0 && i + 1 < argc) {
+            setBinaryCacheDir(argv[++i]);
+        } else if (std::strcmp(argv[i], "--no-program-cache") == 0) {
+            setBinaryCacheDir("");
+        } else if (std::strcmp(argv[i], "--backend") == 0 && i + 1 < argc) {
+            ++i;
+            if (std::strcmp(argv[i], "native") == 0) {
+                native = true;
+            } else if (std::strcmp(argv[i], "opencl") != 0) {
+                std::cerr << "Unknown backend: " << argv[i] << std::endl;
+                return 1;
+            }
+        } else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = static_cast<unsigned>(std::max(0, std::atoi(argv[++i])));
+        } else if (std::strcmp(argv[i], "--list-devices") == 0) {
+            printDevices(listDevices(), std::cout);
+            return 0;
+        } else if (std::strcmp(argv[i], "--device") == 0 && i + 1 < argc) {
+            deviceSelector = argv[++i];
+        } else if (std::strcmp(argv[i], "--multi-device") == 0) {
+            multiDevice = true;
+        } else if (std::strcmp(argv[i], "--sub-devices") == 0 && i + 1 < argc) {
+            subDevices = static_cast<unsigned>(std::max(0, std::atoi(argv[++i])));
+            multiDevice = true;
+        } else if (std::strcmp(argv[i], "--headless") == 0) {
+            headless = true;
+        } else if (std::strcmp(argv[i], "--verify") == 0) {
+            headless = true;
+            benchmark.verify = true;
+        } else if (std::strcmp(argv[i], "--steps") == 0 && i + 1 < argc) {
+            benchmark.steps = std::max(1, std::atoi(argv[++i]));
+        } else if (std::strcmp(argv[i], "--work-group") == 0 && i + 1 < argc) {
+            workGroupSize = static_cast<size_t>(std::max(0, std::atoi(argv[++i])));
+        } else if (std::strcmp(argv[i], "--sweep") == 0) {
+            sweep = true;
+        } else if (std::strcmp(argv[i], "--csv") == 0 && i + 1 < argc) {
+            benchmark.csvPath = argv[++i];
+        } else if (std::strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            recordPath = argv[++i];
+        } else if (std::strcmp(argv[i], "--record-every") == 0 && i + 1 < argc) {
+            recordInterval = std::max(1, std::atoi(argv[++i]));
+        } else if (std::strcmp(argv[i], "--checksum-every") == 0 && i + 1 < argc) {
+            checksumInterval = std::max(1, std::atoi(argv[++i]));
+        } else if (std::strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replayPath = argv[++i];
+        } else {
+            std::cerr << "Unknown option: " << argv[i] << std::endl;
+            return 1;
+        }
+    }
+
+    // A replay takes the world and the flock size from the file, and needs no backend
+    TrajectoryReader replay;
+    bool replaying = !replayPath.empty();
+    if (replaying && (headless || !recordPath.empty())) {
+        std::cerr << "--replay cannot be combined with --headless or --record." << std::endl;
+        return 1;
+    }
+    if (replaying) {
+        if (!replay.open(replayPath))
+            return 1;
+        if (replay.frames() == 0) {
+            std::cerr << replayPath << ": no frames recorded" << std::endl;
+            return 1;
+        }
+        params.boids = replay.size();
+        params.width = replay.header().width;
+        params.height = replay.header().height;
+    }
+    // A headless recording runs a single configuration
+    if (!recordPath.empty() && (sweep || benchmark.verify)) {
+        std::cerr << "--record cannot be combined with --sweep or --verify." << std::endl;
         return 1;
     }
 
-    std::string kernelCode((std::istreambuf_iterator<char>(kernelFile)), std::istreambuf_iterator<char>());
-    const char* kernelSource = kernelCode.c_str();
-    size_t sourceSize = kernelCode.size();
+    int numBoids = params.boids;
 
-    // Initialize OpenCL
-    cl_platform_id platform;
-    clGetPlatformIDs(1, &platform, NULL);
+    // The native backend has no tiled kernel, its brute force already works in blocks
+    bool bruteForce = kernel == ClKernel::BruteForce || kernel == ClKernel::Tiled;
 
-    cl_device_id device;
-    clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &device, NULL);
+    // The strips of the multi-device mode only run the grid pipeline
+    if (multiDevice && (bruteForce || native)) {
+        std::cerr << "The multi-device mode only supports the OpenCL grid pipeline." << std::endl;
+        return 1;
+    }
+    // Strips hand back their boids grouped by strip, so a boid would change slots between
+    // recorded frames
+    if (multiDevice && !recordPath.empty()) {
+        std::cerr << "--record does not support the multi-device mode." << std::endl;
+        return 1;
+    }
+    // Strips exchange boids in the order their atomics hand them out
+    if (multiDevice && (params.deterministic || benchmark.verify)) {
+        std::cerr << "The multi-device mode has no deterministic mode." << std::endl;
+        return 1;
+    }
+    if (native && benchmark.verify) {
+        std::cerr << "--verify checks the OpenCL backend against the native one, use --backend opencl." << std::endl;
+        return 1;
+    }
+    // Species, predators and the steering field only run in the OpenCL grid update, which
+    // the native reference of --verify does not have
+    if (params.populations()) {
+        if (native || multiDevice || bruteForce || benchmark.verify) {
+            std::cerr << "Species, predators, obstacles and attractors only run with the OpenCL grid kernel, without --verify." << std::endl;
+            return 1;
+        }
+        kernel = ClKernel::Grid;
+    }
 
-    cl_context context = clCreateContext(NULL, 1, &device, NULL, NULL, NULL);
-    cl_int command_queue_result;
-    cl_queue_properties queue_properties[] = {0};
-    cl_command_queue queue = clCreateCommandQueueWithProperties(context, device, queue_properties, &command_queue_result);
-    assert(command_queue_result == CL_SUCCESS);
+    // Run without a window, font or renderer
+    if (headless) {
+        benchmark.params = params;
+        benchmark.stepsPerFrame = stepsPerFrame;
+        benchmark.bruteForce = bruteForce;
+        // Sweeping with the automatic pick measures every kernel, to find the crossover
+        if (sweep && kernel == ClKernel::Auto)
+            benchmark.kernels = {ClKernel::BruteForce, ClKernel::Tiled, ClKernel::Grid};
+        else
+            benchmark.kernels = {kernel};
+        benchmark.native = native;
+        benchmark.threads = threads;
+        benchmark.deviceSelector = deviceSelector;
+        benchmark.multiDevice = multiDevice;
+        benchmark.subDevices = subDevices;
+        benchmark.boidCounts = sweep ? sweepBoidCounts(native ? (bruteForce ? ClKernel::BruteForce : ClKernel::Grid) : kernel) : std::vector<int>{numBoids};
+        benchmark.workGroupSizes = sweep ? sweepWorkGroupSizes() : std::vector<size_t>{workGroupSize};
+        // Sweeps also measure the grid without sorting, to show what the sort buys
+        benchmark.sortIntervals = (sweep && sortInterval != 0) ? std::vector<int>{0, sortInterval} : std::vector<int>{sortInterval};
+        benchmark.recordPath = recordPath;
+        benchmark.recordInterval = recordInterval;
+        return runBenchmark(benchmark);
+    }
 
-    // Create buffer for boids
-    cl_mem boidBuffer = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(Boid) * NUM_BOIDS, NULL, NULL);
+    // Create SFML window, before any OpenCL context so the two can share buffers
+    sf::RenderWindow window(sf::VideoMode(static_cast<unsigned>(params.width), static_cast<unsigned>(params.height)), "Boid Simulation");
 
     // Initialize boids with random positions and velocities
-    std::vector<Boid> boids(NUM_BOIDS);
-    for (int i = 0; i < NUM_BOIDS; ++i) {
-        boids[i].x = static_cast<float>(rand()) / RAND_MAX * WIDTH;
-        boids[i].y = static_cast<float>(rand()) / RAND_MAX * HEIGHT;
-        boids[i].vx = static_cast<float>(rand()) / RAND_MAX * 10.0f - 5.0f;
-        boids[i].vy = static_cast<float>(rand()) / RAND_MAX * 10.0f - 5.0f;
+    std::vector<Boid> boids(numBoids);
+    randomBoids(boids, params.width, params.height, params.seed);
+
+    // OpenCL objects, only used by the OpenCL backend
+    cl_context context = NULL;
+    cl_command_queue queue = NULL;
+    cl_program program = NULL;
+    bool interop = false;
+    // Builds of boid.cl for every set of rules used so far, and the one in progress with
+    // the rules it was started for
+    std::unique_ptr<ProgramCache> programs;
+    std::future<cl_program> rebuild;
+    SimParams rebuildParams;
+
+    // Create the simulation. With OpenCL on a single device its state lives on the device,
+    // clSimulation points at it and the host reads it back through staging buffers
+    std::unique_ptr<Simulation> simulation;
+    ClSimulation* clSimulation = nullptr;
+    NativeSimulation* nativeSimulation = nullptr;
+    if (replaying) {
+        // Frames come from the file
+        replay.frame(0, boids.data());
+    } else if (native) {
+        nativeSimulation = new NativeSimulation(params, numBoids, bruteForce, threads);
+        simulation.reset(nativeSimulation);
+    } else if (multiDevice) {
+        // Load kernel source from file
+        std::string kernelCode;
+        if (!loadKernelSource("boid.cl", kernelCode)) {
+            std::cerr << "Failed to open kernel file." << std::endl;
+            return 1;
+        }
+
+        // One horizontal strip of the world per device
+        std::vector<cl_device_id> devices = pickDevices(deviceSelector, subDevices);
+        if (devices.empty())
+            return 1;
+        MultiDeviceSimulation* multiDeviceSimulation = new MultiDeviceSimulation(devices, kernelCode, params, numBoids, workGroupSize);
+        simulation.reset(multiDeviceSimulation);
+        for (cl_device_id device : devices)
+            clReleaseDevice(device);
+        if (!multiDeviceSimulation->ready())
+            return 1;
+    } else {
+        // Load kernel source from file
+        std::string kernelCode;
+        if (!loadKernelSource("boid.cl", kernelCode)) {
+            std::cerr << "Failed to open kernel file." << std::endl;
+            return 1;
+        }
+
+        // Initialize OpenCL
+        cl_platform_id platform;
+        cl_device_id device;
+        if (!pickDevice(platform, device, deviceSelector)) {
+            std::cerr << "No OpenCL device found." << std::endl;
+            return 1;
+        }
+
+        // Share the context with the window's GL context when the device supports it
+        interop = !noInterop && BoidRenderer::interopSupported(device);
+        if (interop) {
+            window.setActive(true);
+            std::vector<cl_context_properties> context_properties = BoidRenderer::interopContextProperties(platform);
+            if (!context_properties.empty())
+                context = clCreateContext(context_properties.data(), 1, &device, NULL, NULL, NULL);
+            interop = context != NULL;
+        }
+        if (context == NULL)
+            context = clCreateContext(NULL, 1, &device, NULL, NULL, NULL);
+        cl_int command_queue_result;
+        cl_queue_properties queue_properties[] = {0};
+        queue = clCreateCommandQueueWithProperties(context, device, queue_properties, &command_queue_result);
+        assert(command_queue_result == CL_SUCCESS);
+
+        // Create OpenCL program, specialized for the flocking rules
+        programs.reset(new ProgramCache(context, device, kernelCode));
+        program = programs->get(kernelBuildOptions(params));
+        if (program == NULL) {
+            programs.reset();
+            clReleaseCommandQueue(queue);
+            clReleaseContext(context);
+            return 1;
+        }
+
+        clSimulation = new ClSimulation(context, device, queue, program, params, numBoids, kernel, workGroupSize);
+        clSimulation->setSortInterval(sortInterval);
+        simulation.reset(clSimulation);
+        if (!clSimulation->ready())
+            return 1;
     }
 
-    // Create OpenCL program
-    cl_program program = clCreateProgramWithSource(context, 1, &kernelSource, &sourceSize, NULL);
-    clBuildProgram(program, 1, &device, NULL, NULL, NULL);
+    // Pinned (host-allocated) staging buffers for readback. They are used alternately:
+    // the renderer draws from one while the device copies the next frame into the other
+    cl_mem stagingBuffers[2] = {NULL, NULL};
+    if (clSimulation) {
+        stagingBuffers[0] = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, sizeof(Boid) * numBoids, NULL, NULL);
+        stagingBuffers[1] = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, sizeof(Boid) * numBoids, NULL, NULL);
+    }
+    Boid* mappedBoids[2] = {nullptr, nullptr};
+    cl_event mapEvents[2] = {NULL, NULL};
+    int drawSlot = -1;    // Mapped slot the renderer currently draws from
+    int pendingSlot = -1; // Slot whose readback is still in flight
 
-    // Create kernel
-    cl_kernel kernel = clCreateKernel(program, "update_boids", NULL);
+    // Upload the initial state once, it stays resident in the backend from now on
+    if (simulation)
+        simulation->upload(boids.data());
 
-    // Set kernel arguments
-    clSetKernelArg(kernel, 0, sizeof(cl_mem), &boidBuffer);
-    clSetKernelArg(kernel, 1, sizeof(int), &NUM_BOIDS);
-    float dt = 0.1f;
-    clSetKernelArg(kernel, 2, sizeof(float), &dt);
-    clSetKernelArg(kernel, 3, sizeof(float), &WIDTH);
-    clSetKernelArg(kernel, 4, sizeof(float), &HEIGHT);
+    // Record the state every recordInterval steps, starting with the initial one. The
+    // OpenCL state is read asynchronously, in upload order; the recorder's writer thread
+    // waits for it
+    std::unique_ptr<TrajectoryRecorder> recorder;
+    long long stepCount = 0;
+    auto recordFrame = [&]() {
+        Boid* frame = recorder->acquire();
+        if (frame == nullptr)
+            return;
+        if (clSimulation) {
+            cl_event event;
+            clEnqueueReadBuffer(queue, clSimulation->orderedState(), CL_FALSE, 0, sizeof(Boid) * numBoids, frame, 0, NULL, &event);
+            clFlush(queue);
+            recorder->submit(frame, stepCount, event);
+        } else {
+            simulation->download(frame);
+            recorder->submit(frame, stepCount);
+        }
+    };
 
-    // Create SFML window
-    sf::RenderWindow window(sf::VideoMode(WIDTH, HEIGHT), "Boid Simulation");
+    // Deterministic runs print checksums to compare against other runs and --verify
+    auto printChecksum = [&]() {
+        BoidChecksum checksum;
+        if (clSimulation) {
+            checksum = clSimulation->checksum();
+        } else {
+            simulation->download(boids.data());
+            checksum = checksumBoids(boids.data(), numBoids);
+        }
+        char line[64];
+        std::snprintf(line, sizeof(line), "step %lld: checksum %016llx", stepCount,
+                      static_cast<unsigned long long>(checksum.hash()));
+        std::cout << line << std::endl;
+    };
+    bool printChecksums = params.deterministic && simulation;
+    if (printChecksums)
+        printChecksum();
+
+    if (!recordPath.empty()) {
+        recorder.reset(new TrajectoryRecorder(numBoids, params.width, params.height, recordInterval));
+        if (!recorder->open(recordPath)) {
+            std::cerr << "Failed to create " << recordPath << std::endl;
+            return 1;
+        }
+        recordFrame();
+    }
+    int replayFrame = 0;
+    uint64_t replayStep = replaying ? replay.step(0) : 0;
+
+    // Create the renderer, drawing straight from a shared GL buffer when possible
+    BoidRenderer renderer(window, numBoids, interop ? context : NULL, program);
+    if (renderer.usesInterop())
+        renderer.updateFromDevice(queue, clSimulation->state());
 
     // Declare Font
     sf::Font font;
@@ -98,6 +422,12 @@ int main() {
     // Clock for measuring time
     sf::Clock clock;
 
+    // Live tweaking of the flocking rules (single-device OpenCL and native backends):
+    // Q/A, W/S and E/D raise/lower the cohesion, alignment and separation factors,
+    // R/F the speed limit. The radii size the grid and stay fixed.
+    bool liveTweaking = clSimulation || nativeSimulation;
+    bool rulesChanged = false;
+
     // Main loop
     while (window.isOpen()) {
         // Process events
@@ -105,39 +435,139 @@ int main() {
         while (window.pollEvent(event)) {
             if (event.type == sf::Event::Closed)
                 window.close();
-            
+
             if (event.type == sf::Event::KeyPressed) {
                 if (event.key.code == sf::Keyboard::Space) {
                     // Toggle the value of runSimulation when the space key is pressed
                     runSimulation = !runSimulation;
                 }
+
+                float* rule = nullptr;
+                float scale = 1.25f;
+                switch (event.key.code) {
+                case sf::Keyboard::Q: rule = &params.cohFactor; break;
+                case sf::Keyboard::A: rule = &params.cohFactor; scale = 0.8f; break;
+                case sf::Keyboard::W: rule = &params.alignFactor; break;
+                case sf::Keyboard::S: rule = &params.alignFactor; scale = 0.8f; break;
+                case sf::Keyboard::E: rule = &params.sepFactor; break;
+                case sf::Keyboard::D: rule = &params.sepFactor; scale = 0.8f; break;
+                case sf::Keyboard::R: rule = &params.maxSpeed; break;
+                case sf::Keyboard::F: rule = &params.maxSpeed; scale = 0.8f; break;
+                default: break;
+                }
+                if (rule && liveTweaking) {
+                    *rule *= scale;
+                    rulesChanged = true;
+                }
+            }
+        }
+
+        // Switch to the program rebuilt for the new rules once it is ready. A failed
+        // build has printed its log, and the old program keeps running
+        if (rebuild.valid() && rebuild.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+            cl_program rebuilt = rebuild.get();
+            if (rebuilt != NULL) {
+                clSimulation->setProgram(rebuilt, rebuildParams);
+                clReleaseProgram(program);
+                program = rebuilt;
             }
         }
 
+        // Apply changed rules. The native backend takes them at once; OpenCL rebuilds the
+        // program in the background (or finds it cached) while frames keep running with
+        // the old one, and only one rebuild is in flight at a time
+        if (rulesChanged && nativeSimulation) {
+            nativeSimulation->setRules(params);
+            rulesChanged = false;
+        } else if (rulesChanged && !rebuild.valid()) {
+            ProgramCache* cache = programs.get();
+            std::string options = kernelBuildOptions(params);
+            rebuild = std::async(std::launch::async, [cache, options] { return cache->get(options); });
+            rebuildParams = params;
+            rulesChanged = false;
+        }
+
+        // Pick up the readback issued last frame, and release the one it replaces
+        if (pendingSlot >= 0) {
+            clWaitForEvents(1, &mapEvents[pendingSlot]);
+            clReleaseEvent(mapEvents[pendingSlot]);
+            mapEvents[pendingSlot] = NULL;
+            if (drawSlot >= 0) {
+                clEnqueueUnmapMemObject(queue, stagingBuffers[drawSlot], mappedBoids[drawSlot], 0, NULL, NULL);
+                mappedBoids[drawSlot] = nullptr;
+            }
+            drawSlot = pendingSlot;
+            pendingSlot = -1;
+        }
+
         // Only execute the simulation if runSimulation is true
-        if (runSimulation) {
-            // Execute OpenCL kernel
-            clEnqueueWriteBuffer(queue, boidBuffer, CL_TRUE, 0, sizeof(Boid) * NUM_BOIDS, boids.data(), 0, NULL, NULL);
-            size_t globalWorkSize = NUM_BOIDS;
-            clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &globalWorkSize, NULL, 0, NULL, NULL);
-            clEnqueueReadBuffer(queue, boidBuffer, CL_TRUE, 0, sizeof(Boid) * NUM_BOIDS, boids.data(), 0, NULL, NULL);
+        if (runSimulation && replaying) {
+            // Advance one recording interval per drawn frame, and loop at the end. Where
+            // frames were dropped while recording, the last one before the gap stays up
+            replayStep += replay.header().interval;
+            if (replayFrame + 1 == replay.frames()) {
+                replayFrame = 0;
+                replayStep = replay.step(0);
+            } else if (replay.step(replayFrame + 1) <= replayStep) {
+                ++replayFrame;
+            }
+            replay.frame(replayFrame, boids.data());
+        } else if (runSimulation) {
+            // Advance the simulation, the state never leaves the backend between steps
+            for (int step = 0; step < stepsPerFrame; ++step) {
+                simulation->step();
+                ++stepCount;
+                if (recorder && stepCount % recordInterval == 0)
+                    recordFrame();
+                if (printChecksums && stepCount % checksumInterval == 0)
+                    printChecksum();
+            }
+
+            if (!clSimulation) {
+                // The native and multi-device backends download straight into host memory
+                simulation->download(boids.data());
+            } else if (renderer.usesInterop()) {
+                // Positions go straight from the state buffer into the vertex buffer
+                renderer.updateFromDevice(queue, clSimulation->state());
+            } else {
+                // Read back asynchronously into the staging slot that is not being drawn
+                int slot = (drawSlot == 0) ? 1 : 0;
+                cl_int map_result;
+                clEnqueueCopyBuffer(queue, clSimulation->state(), stagingBuffers[slot], 0, 0, sizeof(Boid) * numBoids, 0, NULL, NULL);
+                mappedBoids[slot] = static_cast<Boid*>(clEnqueueMapBuffer(queue, stagingBuffers[slot], CL_FALSE, CL_MAP_READ, 0, sizeof(Boid) * numBoids,
+                                                                          0, NULL, &mapEvents[slot], &map_result));
+                assert(map_result == CL_SUCCESS);
+                pendingSlot = slot;
+                clFlush(queue);
+            }
         }
 
+        // Without interop, draw the latest completed readback, or the initial state before the first one
+        if (!renderer.usesInterop())
+            renderer.updateFromHost((drawSlot >= 0) ? mappedBoids[drawSlot] : boids.data());
+
         // Measure elapsed time and calculate FPS
-        sf::Time elapsedTime = clock.restart(); 
+        sf::Time elapsedTime = clock.restart();
         float fps = 1.0f / elapsedTime.asSeconds();
 
-        // Update FPS text
-        fpsText.setString("FPS: " + std::to_string(static_cast<int>(fps)));
+        // Update FPS text, with the current rules when they can be tweaked
+        std::string status = "FPS: " + std::to_string(static_cast<int>(fps));
+        if (liveTweaking) {
+            char rules[128];
+            std::snprintf(rules, sizeof(rules), "\ncohesion %.3g  alignment %.3g  separation %.3g  speed %.3g%s",
+                          params.cohFactor, params.alignFactor, params.sepFactor, params.maxSpeed,
+                          (rebuild.valid() || rulesChanged) ? "  (rebuilding)" : "");
+            status += rules;
+        }
+        if (replaying)
+            status += "\nframe " + std::to_string(replayFrame + 1) + " / " + std::to_string(replay.frames()) + "  step " +
+                      std::to_string(replay.step(replayFrame));
+        fpsText.setString(status);
         // Clear window
         window.clear();
 
-        // Render boids using SFML
-        for (int i = 0; i < NUM_BOIDS; ++i) {
-            sf::CircleShape shape(1); // Example: Render each boid as a circle
-            shape.setPosition(boids[i].x, boids[i].y);
-            window.draw(shape);
-        }
+        // Render all boids in a single draw call
+        renderer.draw();
 
         // Show Fps
         window.draw(fpsText);
@@ -145,11 +575,35 @@ int main() {
         window.display();
     }
     // Clean up
-    clReleaseKernel(kernel);
-    clReleaseProgram(program);
-    clReleaseCommandQueue(queue);
-    clReleaseContext(context);
-    clReleaseMemObject(boidBuffer);
+    if (recorder) {
+        // Writes every frame still queued, so it must run before the queue goes away
+        recorder->close();
+        std::cout << "Recorded " << recorder->recorded() << " frames to " << recordPath;
+        if (recorder->dropped() > 0)
+            std::cout << " (" << recorder->dropped() << " dropped, the writer fell behind)";
+        std::cout << std::endl;
+    }
+    if (clSimulation) {
+        if (rebuild.valid()) {
+            cl_program rebuilt = rebuild.get();
+            if (rebuilt != NULL)
+                clReleaseProgram(rebuilt);
+        }
+        programs.reset();
+        clFinish(queue);
+        for (int slot = 0; slot < 2; ++slot) {
+            if (mapEvents[slot] != NULL)
+                clReleaseEvent(mapEvents[slot]);
+            if (mappedBoids[slot] != nullptr)
+                clEnqueueUnmapMemObject(queue, stagingBuffers[slot], mappedBoids[slot], 0, NULL, NULL);
+        }
+        clFinish(queue);
+        clReleaseProgram(program);
+        clReleaseCommandQueue(queue);
+        clReleaseContext(context);
+        clReleaseMemObject(stagingBuffers[0]);
+        clReleaseMemObject(stagingBuffers[1]);
+    }
 
     return 0;
 }
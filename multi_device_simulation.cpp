@@ -0,0 +1,265 @@
+#include "multi_device_simulation.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cfloat>
+#include <cmath>
+#include "cl_setup.hpp"
+#include "population.hpp"
+
+MultiDeviceSimulation::MultiDeviceSimulation(const std::vector<cl_device_id>& devices, const std::string& kernelSource,
+                                             const SimParams& params, int numBoids, size_t workGroupSize)
+    : numBoids(numBoids), workGroupSize(workGroupSize) {
+    // A strip owns its boids plus a halo of at most every other boid
+    capacity = 2 * numBoids;
+    cellSize = params.cellSize();
+    gridW = static_cast<int>(std::ceil(params.width / cellSize));
+    gridH = static_cast<int>(std::ceil(params.height / cellSize));
+
+    // Strips must be at least one cell high, so the halo only ever comes from the next
+    // strip: height / count >= cellSize. gridH rounds up and would allow thinner strips
+    size_t fullRows = std::max(1, static_cast<int>(std::floor(params.height / cellSize)));
+    size_t count = std::min(devices.size(), fullRows);
+    stripList.resize(count);
+    for (size_t s = 0; s < count; ++s) {
+        Strip& strip = stripList[s];
+        cl_device_id device = devices[s];
+        strip.y0 = params.height * s / count;
+        strip.y1 = (s + 1 == count) ? FLT_MAX : params.height * (s + 1) / count;
+
+        // Owned boids are in rows [y0 / cellSize, y1 / cellSize], the halo is within one
+        // more row on each side
+        int lastRow = (s + 1 == count) ? gridH - 1 : std::min(gridH - 1, static_cast<int>(strip.y1 / cellSize) + 1);
+        strip.row0 = std::max(0, static_cast<int>(strip.y0 / cellSize) - 1);
+        strip.rows = lastRow - strip.row0 + 1;
+        strip.numCells = gridW * strip.rows;
+
+        // Create the context, queue and program of this device
+        strip.context = clCreateContext(NULL, 1, &device, NULL, NULL, NULL);
+        cl_int command_queue_result;
+        cl_queue_properties queue_properties[] = {0};
+        strip.queue = clCreateCommandQueueWithProperties(strip.context, device, queue_properties, &command_queue_result);
+        assert(command_queue_result == CL_SUCCESS);
+        strip.program = buildProgram(strip.context, device, kernelSource, kernelBuildOptions(plainFlocking(params)));
+        if (strip.program == NULL) {
+            // Give up on every strip, see ready()
+            clReleaseCommandQueue(strip.queue);
+            clReleaseContext(strip.context);
+            stripList.resize(s);
+            releaseStrips();
+            return;
+        }
+
+        // Create buffers
+        strip.state = clCreateBuffer(strip.context, CL_MEM_READ_WRITE, sizeof(Boid) * capacity, NULL, NULL);
+        strip.updated = clCreateBuffer(strip.context, CL_MEM_READ_WRITE, sizeof(Boid) * numBoids, NULL, NULL);
+        strip.sortedBuffer = clCreateBuffer(strip.context, CL_MEM_READ_WRITE, sizeof(Boid) * capacity, NULL, NULL);
+        strip.boidCellBuffer = clCreateBuffer(strip.context, CL_MEM_READ_WRITE, sizeof(cl_int) * capacity, NULL, NULL);
+        strip.boidRankBuffer = clCreateBuffer(strip.context, CL_MEM_READ_WRITE, sizeof(cl_int) * capacity, NULL, NULL);
+        strip.cellCountBuffer = clCreateBuffer(strip.context, CL_MEM_READ_WRITE, sizeof(cl_int) * strip.numCells, NULL, NULL);
+        strip.cellStartBuffer = clCreateBuffer(strip.context, CL_MEM_READ_WRITE, sizeof(cl_int) * (strip.numCells + 1), NULL, NULL);
+        strip.outbox = clCreateBuffer(strip.context, CL_MEM_READ_WRITE, sizeof(Boid) * 3 * numBoids, NULL, NULL);
+        strip.counterBuffer = clCreateBuffer(strip.context, CL_MEM_READ_WRITE, sizeof(cl_int) * 4, NULL, NULL);
+
+        // Create kernels
+        strip.resetCellsKernel = clCreateKernel(strip.program, "reset_cells", NULL);
+        strip.countCellsKernel = clCreateKernel(strip.program, "count_cells", NULL);
+        strip.scanCellsKernel = clCreateKernel(strip.program, "scan_cells", NULL);
+        strip.scatterBoidsKernel = clCreateKernel(strip.program, "scatter_boids", NULL);
+        strip.gridKernel = clCreateKernel(strip.program, "update_boids_grid", NULL);
+        strip.splitKernel = clCreateKernel(strip.program, "split_strip", NULL);
+
+        // Set kernel arguments (the boid counts are set every step). The program is built
+        // without populations, so their arguments are never read
+        cl_mem noBuffer = NULL;
+        int noField = 0;
+        clSetKernelArg(strip.resetCellsKernel, 0, sizeof(cl_mem), &strip.cellCountBuffer);
+        clSetKernelArg(strip.resetCellsKernel, 1, sizeof(int), &strip.numCells);
+
+        clSetKernelArg(strip.countCellsKernel, 0, sizeof(cl_mem), &strip.state);
+        clSetKernelArg(strip.countCellsKernel, 1, sizeof(cl_mem), &strip.boidCellBuffer);
+        clSetKernelArg(strip.countCellsKernel, 2, sizeof(cl_mem), &strip.boidRankBuffer);
+        clSetKernelArg(strip.countCellsKernel, 3, sizeof(cl_mem), &strip.cellCountBuffer);
+        clSetKernelArg(strip.countCellsKernel, 5, sizeof(float), &cellSize);
+        clSetKernelArg(strip.countCellsKernel, 6, sizeof(int), &gridW);
+        clSetKernelArg(strip.countCellsKernel, 7, sizeof(int), &strip.rows);
+        clSetKernelArg(strip.countCellsKernel, 8, sizeof(int), &strip.row0);
+
+        clGetKernelWorkGroupInfo(strip.scanCellsKernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &strip.scanGroupSize, NULL);
+        strip.scanGroupSize = std::min<size_t>(strip.scanGroupSize, 256);
+        clSetKernelArg(strip.scanCellsKernel, 0, sizeof(cl_mem), &strip.cellCountBuffer);
+        clSetKernelArg(strip.scanCellsKernel, 1, sizeof(cl_mem), &strip.cellStartBuffer);
+        clSetKernelArg(strip.scanCellsKernel, 2, sizeof(int), &strip.numCells);
+        clSetKernelArg(strip.scanCellsKernel, 3, sizeof(cl_int) * strip.scanGroupSize, NULL);
+
+        clSetKernelArg(strip.scatterBoidsKernel, 0, sizeof(cl_mem), &strip.state);
+        clSetKernelArg(strip.scatterBoidsKernel, 1, sizeof(cl_mem), &strip.boidCellBuffer);
+        clSetKernelArg(strip.scatterBoidsKernel, 2, sizeof(cl_mem), &strip.boidRankBuffer);
+        clSetKernelArg(strip.scatterBoidsKernel, 3, sizeof(cl_mem), &strip.cellStartBuffer);
+        clSetKernelArg(strip.scatterBoidsKernel, 4, sizeof(cl_mem), &strip.sortedBuffer);
+        clSetKernelArg(strip.scatterBoidsKernel, 6, sizeof(cl_mem), &noBuffer);
+        clSetKernelArg(strip.scatterBoidsKernel, 7, sizeof(cl_mem), &noBuffer);
+
+        clSetKernelArg(strip.gridKernel, 0, sizeof(cl_mem), &strip.sortedBuffer);
+        clSetKernelArg(strip.gridKernel, 1, sizeof(cl_mem), &strip.boidCellBuffer);
+        clSetKernelArg(strip.gridKernel, 2, sizeof(cl_mem), &strip.boidRankBuffer);
+        clSetKernelArg(strip.gridKernel, 3, sizeof(cl_mem), &strip.cellStartBuffer);
+        clSetKernelArg(strip.gridKernel, 4, sizeof(cl_mem), &strip.updated);
+        clSetKernelArg(strip.gridKernel, 6, sizeof(float), &params.dt);
+        clSetKernelArg(strip.gridKernel, 7, sizeof(float), &params.width);
+        clSetKernelArg(strip.gridKernel, 8, sizeof(float), &params.height);
+        clSetKernelArg(strip.gridKernel, 9, sizeof(float), &cellSize);
+        clSetKernelArg(strip.gridKernel, 10, sizeof(int), &gridW);
+        clSetKernelArg(strip.gridKernel, 11, sizeof(int), &strip.rows);
+        for (cl_uint arg = 12; arg <= 14; ++arg)
+            clSetKernelArg(strip.gridKernel, arg, sizeof(cl_mem), &noBuffer);
+        clSetKernelArg(strip.gridKernel, 15, sizeof(int), &noField);
+        clSetKernelArg(strip.gridKernel, 16, sizeof(int), &noField);
+        clSetKernelArg(strip.gridKernel, 17, sizeof(float), &FIELD_CELL);
+
+        // The kept boids are compacted back into state, ready for the next step
+        clSetKernelArg(strip.splitKernel, 0, sizeof(cl_mem), &strip.updated);
+        clSetKernelArg(strip.splitKernel, 1, sizeof(cl_mem), &strip.state);
+        clSetKernelArg(strip.splitKernel, 2, sizeof(cl_mem), &strip.outbox);
+        clSetKernelArg(strip.splitKernel, 3, sizeof(cl_mem), &strip.counterBuffer);
+        clSetKernelArg(strip.splitKernel, 5, sizeof(int), &numBoids);
+        clSetKernelArg(strip.splitKernel, 6, sizeof(float), &strip.y0);
+        clSetKernelArg(strip.splitKernel, 7, sizeof(float), &strip.y1);
+        clSetKernelArg(strip.splitKernel, 8, sizeof(float), &cellSize);
+    }
+}
+
+MultiDeviceSimulation::~MultiDeviceSimulation() {
+    releaseStrips();
+}
+
+void MultiDeviceSimulation::releaseStrips() {
+    for (Strip& strip : stripList) {
+        clFinish(strip.queue);
+        clReleaseKernel(strip.resetCellsKernel);
+        clReleaseKernel(strip.countCellsKernel);
+        clReleaseKernel(strip.scanCellsKernel);
+        clReleaseKernel(strip.scatterBoidsKernel);
+        clReleaseKernel(strip.gridKernel);
+        clReleaseKernel(strip.splitKernel);
+        clReleaseMemObject(strip.state);
+        clReleaseMemObject(strip.updated);
+        clReleaseMemObject(strip.sortedBuffer);
+        clReleaseMemObject(strip.boidCellBuffer);
+        clReleaseMemObject(strip.boidRankBuffer);
+        clReleaseMemObject(strip.cellCountBuffer);
+        clReleaseMemObject(strip.cellStartBuffer);
+        clReleaseMemObject(strip.outbox);
+        clReleaseMemObject(strip.counterBuffer);
+        clReleaseProgram(strip.program);
+        clReleaseCommandQueue(strip.queue);
+        clReleaseContext(strip.context);
+    }
+    stripList.clear();
+}
+
+void MultiDeviceSimulation::route(const Boid& boid) {
+    size_t s = 0;
+    while (boid.y >= stripList[s].y1)
+        ++s;
+
+    stripList[s].migrants.push_back(boid);
+    if (s > 0 && boid.y < stripList[s].y0 + cellSize)
+        stripList[s - 1].halo.push_back(boid);
+    if (s + 1 < stripList.size() && boid.y >= stripList[s].y1 - cellSize)
+        stripList[s + 1].halo.push_back(boid);
+}
+
+void MultiDeviceSimulation::upload(const Boid* boids) {
+    // Every boid arrives at its strip as a migrant of the first step
+    for (Strip& strip : stripList) {
+        strip.kept = 0;
+        strip.migrants.clear();
+        strip.halo.clear();
+    }
+    for (int i = 0; i < numBoids; ++i)
+        route(boids[i]);
+}
+
+void MultiDeviceSimulation::download(Boid* boids) {
+    // Kept boids live on the devices, the ones between strips on the host
+    for (Strip& strip : stripList) {
+        if (strip.kept > 0)
+            clEnqueueReadBuffer(strip.queue, strip.state, CL_TRUE, 0, sizeof(Boid) * strip.kept, boids, 0, NULL, NULL);
+        boids = std::copy(strip.migrants.begin(), strip.migrants.end(), boids + strip.kept);
+    }
+}
+
+void MultiDeviceSimulation::enqueue(Strip& strip, cl_kernel launched, size_t globalSize) {
+    const size_t* localSize = NULL;
+    if (workGroupSize > 0) {
+        globalSize = (globalSize + workGroupSize - 1) / workGroupSize * workGroupSize;
+        localSize = &workGroupSize;
+    }
+    clEnqueueNDRangeKernel(strip.queue, launched, 1, NULL, &globalSize, localSize, 0, NULL, NULL);
+}
+
+void MultiDeviceSimulation::step() {
+    // Append the arriving boids and the halo behind the kept boids and advance every
+    // strip. Nothing blocks here, so the devices run concurrently
+    for (Strip& strip : stripList) {
+        int owned = strip.kept + static_cast<int>(strip.migrants.size());
+        int total = owned + static_cast<int>(strip.halo.size());
+        if (!strip.migrants.empty())
+            clEnqueueWriteBuffer(strip.queue, strip.state, CL_FALSE, sizeof(Boid) * strip.kept,
+                                 sizeof(Boid) * strip.migrants.size(), strip.migrants.data(), 0, NULL, NULL);
+        if (!strip.halo.empty())
+            clEnqueueWriteBuffer(strip.queue, strip.state, CL_FALSE, sizeof(Boid) * owned,
+                                 sizeof(Boid) * strip.halo.size(), strip.halo.data(), 0, NULL, NULL);
+
+        cl_int zero = 0;
+        clEnqueueFillBuffer(strip.queue, strip.counterBuffer, &zero, sizeof(zero), 0, sizeof(cl_int) * 4, 0, NULL, NULL);
+        if (owned > 0) {
+            // The grid holds owned and halo boids, only the owned ones are updated
+            clSetKernelArg(strip.countCellsKernel, 4, sizeof(int), &total);
+            clSetKernelArg(strip.scatterBoidsKernel, 5, sizeof(int), &total);
+            clSetKernelArg(strip.gridKernel, 5, sizeof(int), &owned);
+            clSetKernelArg(strip.splitKernel, 4, sizeof(int), &owned);
+            enqueue(strip, strip.resetCellsKernel, strip.numCells);
+            enqueue(strip, strip.countCellsKernel, total);
+            clEnqueueNDRangeKernel(strip.queue, strip.scanCellsKernel, 1, NULL, &strip.scanGroupSize, &strip.scanGroupSize, 0, NULL, NULL);
+            enqueue(strip, strip.scatterBoidsKernel, total);
+            enqueue(strip, strip.gridKernel, owned);
+            enqueue(strip, strip.splitKernel, owned);
+        }
+        clEnqueueReadBuffer(strip.queue, strip.counterBuffer, CL_FALSE, 0, sizeof(cl_int) * 4, strip.counts, 0, NULL, NULL);
+        clFlush(strip.queue);
+    }
+
+    // Read back what left each strip and the halo it offers its neighbors
+    for (Strip& strip : stripList) {
+        clFinish(strip.queue);
+        strip.kept = strip.counts[0];
+        strip.outgoing.resize(strip.counts[1] + strip.counts[2] + strip.counts[3]);
+        Boid* out = strip.outgoing.data();
+        for (int region = 0; region < 3; ++region) {
+            int count = strip.counts[region + 1];
+            if (count > 0)
+                clEnqueueReadBuffer(strip.queue, strip.outbox, CL_TRUE, sizeof(Boid) * numBoids * region,
+                                    sizeof(Boid) * count, out, 0, NULL, NULL);
+            out += count;
+        }
+        strip.migrants.clear();
+        strip.halo.clear();
+    }
+
+    // Pass the halo on to the strips next door and hand migrants to their new strip
+    for (size_t s = 0; s < stripList.size(); ++s) {
+        Strip& strip = stripList[s];
+        const Boid* migrants = strip.outgoing.data();
+        const Boid* lowerHalo = migrants + strip.counts[1];
+        const Boid* upperHalo = lowerHalo + strip.counts[2];
+        if (s > 0)
+            stripList[s - 1].halo.insert(stripList[s - 1].halo.end(), lowerHalo, upperHalo);
+        if (s + 1 < stripList.size())
+            stripList[s + 1].halo.insert(stripList[s + 1].halo.end(), upperHalo, upperHalo + strip.counts[3]);
+    }
+    for (Strip& strip : stripList)
+        for (int i = 0; i < strip.counts[1]; ++i)
+            route(strip.outgoing[i]);
+}
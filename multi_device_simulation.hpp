@@ -0,0 +1,92 @@
+#pragma once
+
+// Define the target OpenCL version
+#define CL_TARGET_OPENCL_VERSION 300
+
+#include <string>
+#include <vector>
+#include <CL/cl.h>
+#include "boid.hpp"
+#include "params.hpp"
+#include "simulation.hpp"
+
+// Boid simulation split over several OpenCL devices (or sub-devices of one CPU).
+//
+// The world is cut into equal horizontal strips, one per device. Each device owns the
+// boids inside its strip and runs the uniform grid pipeline from boid.cl on them,
+// with the boids of the neighboring strips that are within one cell of the border as
+// read-only halo; its grid only covers its own rows of cells and the two halo rows.
+// After a step only the boids that crossed into another strip and the new halo are
+// read back and passed on, so the traffic grows with the length of the borders rather
+// than with the number of boids.
+//
+// Boids change strips, so download() returns them grouped by strip rather than in
+// upload order.
+class MultiDeviceSimulation : public Simulation {
+public:
+    // Every device gets its own context, queue and build of kernelSource with params,
+    // without the populations (see plainFlocking). workGroupSize 0 leaves the local size
+    // to the runtime.
+    MultiDeviceSimulation(const std::vector<cl_device_id>& devices, const std::string& kernelSource,
+                          const SimParams& params, int numBoids, size_t workGroupSize = 0);
+    ~MultiDeviceSimulation() override;
+
+    MultiDeviceSimulation(const MultiDeviceSimulation&) = delete;
+    MultiDeviceSimulation& operator=(const MultiDeviceSimulation&) = delete;
+
+    const char* name() const override { return "opencl-multi-device"; }
+    int size() const override { return numBoids; }
+
+    void upload(const Boid* boids) override;
+    void step() override;
+    void download(Boid* boids) override;
+
+    int strips() const { return static_cast<int>(stripList.size()); }
+
+    // False when the program failed to build on one of the devices
+    bool ready() const { return !stripList.empty(); }
+
+private:
+    // One device and the boids it owns
+    struct Strip {
+        cl_context context;
+        cl_command_queue queue;
+        cl_program program;
+        cl_kernel resetCellsKernel, countCellsKernel, scanCellsKernel, scatterBoidsKernel, gridKernel, splitKernel;
+        size_t scanGroupSize;
+
+        // state holds the owned boids followed by the halo, updated receives the step
+        cl_mem state, updated;
+        cl_mem sortedBuffer, boidCellBuffer, boidRankBuffer, cellCountBuffer, cellStartBuffer;
+        // Boids leaving the strip and halo for the neighbors, see split_strip
+        cl_mem outbox, counterBuffer;
+
+        // Owned rows [y0, y1); the last strip also takes y == height
+        float y0, y1;
+        // The grid of the strip: its own cell rows and one halo row on each side, starting
+        // at cell row row0 of the world
+        int row0, rows, numCells;
+        // Owned boids at the start of state after the last step
+        int kept = 0;
+        // Boids arriving for the next step
+        std::vector<Boid> migrants;
+        std::vector<Boid> halo;
+        // Read back after a step: kept, migrants, lower halo, upper halo
+        cl_int counts[4];
+        std::vector<Boid> outgoing;
+    };
+
+    void releaseStrips();
+    // Hand a boid to the strip containing it, and as halo to a strip next to it
+    void route(const Boid& boid);
+    void enqueue(Strip& strip, cl_kernel kernel, size_t globalSize);
+
+    int numBoids;
+    size_t workGroupSize;
+    // Boids a strip can hold, owned and halo together
+    int capacity;
+    float cellSize;
+    // Cells of the whole world
+    int gridW, gridH;
+    std::vector<Strip> stripList;
+};
@@ -0,0 +1,331 @@
+#include "native_simulation.hpp"
+
+#include <algorithm>
+#include <cmath>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Boids per thread pool chunk
+static const int GRAIN = 256;
+
+namespace {
+
+// Running sums of the three flocking rules for one boid (see Flock in boid.cl)
+struct Flock {
+    float cohX = 0.0f, cohY = 0.0f;
+    float alignX = 0.0f, alignY = 0.0f;
+    float sepX = 0.0f, sepY = 0.0f;
+    int cohCount = 0, alignCount = 0, sepCount = 0;
+};
+
+#if defined(__AVX2__)
+// 8 lanes
+typedef __m256 vfloat;
+const int SIMD_WIDTH = 8;
+inline vfloat vset(float v) { return _mm256_set1_ps(v); }
+inline vfloat vload(const float* p) { return _mm256_loadu_ps(p); }
+inline vfloat vadd(vfloat a, vfloat b) { return _mm256_add_ps(a, b); }
+inline vfloat vsub(vfloat a, vfloat b) { return _mm256_sub_ps(a, b); }
+inline vfloat vmul(vfloat a, vfloat b) { return _mm256_mul_ps(a, b); }
+inline vfloat vdiv(vfloat a, vfloat b) { return _mm256_div_ps(a, b); }
+inline vfloat vand(vfloat a, vfloat b) { return _mm256_and_ps(a, b); }
+inline vfloat vless(vfloat a, vfloat b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+inline void vstore(float* p, vfloat a) { _mm256_storeu_ps(p, a); }
+#elif defined(__SSE2__)
+// 4 lanes
+typedef __m128 vfloat;
+const int SIMD_WIDTH = 4;
+inline vfloat vset(float v) { return _mm_set1_ps(v); }
+inline vfloat vload(const float* p) { return _mm_loadu_ps(p); }
+inline vfloat vadd(vfloat a, vfloat b) { return _mm_add_ps(a, b); }
+inline vfloat vsub(vfloat a, vfloat b) { return _mm_sub_ps(a, b); }
+inline vfloat vmul(vfloat a, vfloat b) { return _mm_mul_ps(a, b); }
+inline vfloat vdiv(vfloat a, vfloat b) { return _mm_div_ps(a, b); }
+inline vfloat vand(vfloat a, vfloat b) { return _mm_and_ps(a, b); }
+inline vfloat vless(vfloat a, vfloat b) { return _mm_cmplt_ps(a, b); }
+inline void vstore(float* p, vfloat a) { _mm_storeu_ps(p, a); }
+#endif
+
+#if defined(__AVX2__) || defined(__SSE2__)
+inline float vsum(vfloat a) {
+    float lanes[SIMD_WIDTH];
+    vstore(lanes, a);
+    float sum = 0.0f;
+    for (int i = 0; i < SIMD_WIDTH; ++i)
+        sum += lanes[i];
+    return sum;
+}
+#endif
+
+// Accumulate the neighbors [begin, end) of a boid at (px, py)
+void accumulate(const SimParams& params, Flock& flock, float px, float py,
+                const float* x, const float* y, const float* vx, const float* vy, int begin, int end) {
+    const float cohRadiusSq = params.cohRadius * params.cohRadius;
+    const float alignRadiusSq = params.alignRadius * params.alignRadius;
+    const float sepRadiusSq = params.sepRadius * params.sepRadius;
+    int j = begin;
+
+#if defined(__AVX2__) || defined(__SSE2__)
+    // Distances, radius masks and sums for SIMD_WIDTH neighbors at a time;
+    // masked-out lanes contribute exact zeros (also for their NaN/inf quotients)
+    const vfloat pxv = vset(px), pyv = vset(py), one = vset(1.0f);
+    const vfloat cohR2 = vset(cohRadiusSq);
+    const vfloat alignR2 = vset(alignRadiusSq);
+    const vfloat sepR2 = vset(sepRadiusSq);
+    vfloat cohX = vset(0.0f), cohY = vset(0.0f), cohN = vset(0.0f);
+    vfloat alignX = vset(0.0f), alignY = vset(0.0f), alignN = vset(0.0f);
+    vfloat sepX = vset(0.0f), sepY = vset(0.0f), sepN = vset(0.0f);
+    for (; j + SIMD_WIDTH <= end; j += SIMD_WIDTH) {
+        vfloat ox = vload(x + j);
+        vfloat oy = vload(y + j);
+        vfloat dx = vsub(ox, pxv);
+        vfloat dy = vsub(oy, pyv);
+        vfloat distSq = vadd(vmul(dx, dx), vmul(dy, dy));
+
+        vfloat coh = vless(distSq, cohR2);
+        cohX = vadd(cohX, vand(coh, ox));
+        cohY = vadd(cohY, vand(coh, oy));
+        cohN = vadd(cohN, vand(coh, one));
+
+        vfloat align = vless(distSq, alignR2);
+        alignX = vadd(alignX, vand(align, vload(vx + j)));
+        alignY = vadd(alignY, vand(align, vload(vy + j)));
+        alignN = vadd(alignN, vand(align, one));
+
+        vfloat sep = vless(distSq, sepR2);
+        sepX = vsub(sepX, vand(sep, vdiv(dx, distSq)));
+        sepY = vsub(sepY, vand(sep, vdiv(dy, distSq)));
+        sepN = vadd(sepN, vand(sep, one));
+    }
+    flock.cohX += vsum(cohX);
+    flock.cohY += vsum(cohY);
+    flock.cohCount += static_cast<int>(vsum(cohN));
+    flock.alignX += vsum(alignX);
+    flock.alignY += vsum(alignY);
+    flock.alignCount += static_cast<int>(vsum(alignN));
+    flock.sepX += vsum(sepX);
+    flock.sepY += vsum(sepY);
+    flock.sepCount += static_cast<int>(vsum(sepN));
+#endif
+
+    // Remaining neighbors one at a time
+    for (; j < end; ++j) {
+        float dx = x[j] - px;
+        float dy = y[j] - py;
+        float distSq = dx * dx + dy * dy;
+
+        if (distSq < cohRadiusSq) {
+            flock.cohX += x[j];
+            flock.cohY += y[j];
+            flock.cohCount++;
+        }
+
+        if (distSq < alignRadiusSq) {
+            flock.alignX += vx[j];
+            flock.alignY += vy[j];
+            flock.alignCount++;
+        }
+
+        if (distSq < sepRadiusSq) {
+            flock.sepX -= dx / distSq;
+            flock.sepY -= dy / distSq;
+            flock.sepCount++;
+        }
+    }
+}
+
+// Apply the accumulated rules, limit speed, integrate the position and wrap it
+// (see flock_steer in boid.cl)
+void steer(const SimParams& params, const Flock& flock, float& x, float& y, float& vx, float& vy) {
+    // Apply cohesion rule
+    if (flock.cohCount > 0) {
+        vx += (flock.cohX / flock.cohCount - x) * params.cohFactor;
+        vy += (flock.cohY / flock.cohCount - y) * params.cohFactor;
+    }
+
+    // Apply alignment rule
+    if (flock.alignCount > 0) {
+        vx += (flock.alignX / flock.alignCount - vx) * params.alignFactor;
+        vy += (flock.alignY / flock.alignCount - vy) * params.alignFactor;
+    }
+
+    // Apply separation rule
+    if (flock.sepCount > 0) {
+        vx += flock.sepX * params.sepFactor;
+        vy += flock.sepY * params.sepFactor;
+    }
+
+    // Limit speed
+    float speedSq = vx * vx + vy * vy;
+    if (speedSq > params.maxSpeed * params.maxSpeed) {
+        float scale = params.maxSpeed / std::sqrt(speedSq);
+        vx *= scale;
+        vy *= scale;
+    }
+
+    // Update position
+    x += vx * params.dt;
+    y += vy * params.dt;
+
+    // Wrap around boundaries
+    if (x > params.width) x = 0.0f;
+    if (x < 0.0f) x = params.width;
+    if (y > params.height) y = 0.0f;
+    if (y < 0.0f) y = params.height;
+}
+
+} // namespace
+
+void NativeSimulation::State::resize(int n) {
+    x.resize(n);
+    y.resize(n);
+    vx.resize(n);
+    vy.resize(n);
+}
+
+NativeSimulation::NativeSimulation(const SimParams& params, int numBoids, bool bruteForce, unsigned threads)
+    : params(params), numBoids(numBoids), bruteForce(bruteForce), pool(threads) {
+    states[0].resize(numBoids);
+    states[1].resize(numBoids);
+
+    cellSize = params.cellSize();
+    gridW = static_cast<int>(std::ceil(params.width / cellSize));
+    gridH = static_cast<int>(std::ceil(params.height / cellSize));
+    numCells = gridW * gridH;
+    boidCells.resize(numBoids);
+    cellStarts.resize(numCells + 1);
+    sortedIndex.resize(numBoids);
+    sorted.resize(numBoids);
+}
+
+void NativeSimulation::setRules(const SimParams& rules) {
+    params.maxSpeed = rules.maxSpeed;
+    params.cohFactor = rules.cohFactor;
+    params.alignFactor = rules.alignFactor;
+    params.sepFactor = rules.sepFactor;
+}
+
+void NativeSimulation::upload(const Boid* boids) {
+    State& state = states[current];
+    for (int i = 0; i < numBoids; ++i) {
+        state.x[i] = boids[i].x;
+        state.y[i] = boids[i].y;
+        state.vx[i] = boids[i].vx;
+        state.vy[i] = boids[i].vy;
+    }
+}
+
+void NativeSimulation::download(Boid* boids) {
+    const State& state = states[current];
+    for (int i = 0; i < numBoids; ++i)
+        boids[i] = Boid{state.x[i], state.y[i], state.vx[i], state.vy[i]};
+}
+
+void NativeSimulation::step() {
+    if (bruteForce) {
+        pool.parallelFor(numBoids, GRAIN, [this](int begin, int end) { updateBruteForce(begin, end); });
+    } else {
+        binBoids();
+        pool.parallelFor(numBoids, GRAIN, [this](int begin, int end) { updateGrid(begin, end); });
+    }
+
+    // The output of this step is the input of the next one
+    current = 1 - current;
+}
+
+void NativeSimulation::binBoids() {
+    const State& input = states[current];
+
+    // Cell of every boid
+    pool.parallelFor(numBoids, 4096, [&](int begin, int end) {
+        for (int i = begin; i < end; ++i) {
+            int cx = std::min(std::max(static_cast<int>(input.x[i] / cellSize), 0), gridW - 1);
+            int cy = std::min(std::max(static_cast<int>(input.y[i] / cellSize), 0), gridH - 1);
+            boidCells[i] = cy * gridW + cx;
+        }
+    });
+
+    // Stable counting sort into cell order
+    std::fill(cellStarts.begin(), cellStarts.end(), 0);
+    for (int i = 0; i < numBoids; ++i)
+        cellStarts[boidCells[i] + 1]++;
+    for (int c = 0; c < numCells; ++c)
+        cellStarts[c + 1] += cellStarts[c];
+    std::vector<int> fill(cellStarts.begin(), cellStarts.end() - 1);
+    for (int i = 0; i < numBoids; ++i)
+        sortedIndex[fill[boidCells[i]]++] = i;
+
+    // Gather the state in cell order so every cell is contiguous
+    pool.parallelFor(numBoids, 4096, [&](int begin, int end) {
+        for (int slot = begin; slot < end; ++slot) {
+            int i = sortedIndex[slot];
+            sorted.x[slot] = input.x[i];
+            sorted.y[slot] = input.y[i];
+            sorted.vx[slot] = input.vx[i];
+            sorted.vy[slot] = input.vy[i];
+        }
+    });
+}
+
+void NativeSimulation::updateGrid(int begin, int end) {
+    State& output = states[1 - current];
+    const float* x = sorted.x.data();
+    const float* y = sorted.y.data();
+    const float* vx = sorted.vx.data();
+    const float* vy = sorted.vy.data();
+
+    for (int slot = begin; slot < end; ++slot) {
+        float px = x[slot], py = y[slot], pvx = vx[slot], pvy = vy[slot];
+        int cell = boidCells[sortedIndex[slot]];
+        int cx = cell % gridW;
+        int cy = cell / gridW;
+
+        // Loop through the boids of the neighboring cells, skipping ourselves
+        Flock flock;
+        for (int ny = std::max(cy - 1, 0); ny <= std::min(cy + 1, gridH - 1); ++ny) {
+            for (int nx = std::max(cx - 1, 0); nx <= std::min(cx + 1, gridW - 1); ++nx) {
+                int neighborCell = ny * gridW + nx;
+                int first = cellStarts[neighborCell];
+                int last = cellStarts[neighborCell + 1];
+                if (slot >= first && slot < last) {
+                    accumulate(params, flock, px, py, x, y, vx, vy, first, slot);
+                    accumulate(params, flock, px, py, x, y, vx, vy, slot + 1, last);
+                } else {
+                    accumulate(params, flock, px, py, x, y, vx, vy, first, last);
+                }
+            }
+        }
+
+        steer(params, flock, px, py, pvx, pvy);
+        int i = sortedIndex[slot];
+        output.x[i] = px;
+        output.y[i] = py;
+        output.vx[i] = pvx;
+        output.vy[i] = pvy;
+    }
+}
+
+void NativeSimulation::updateBruteForce(int begin, int end) {
+    const State& input = states[current];
+    State& output = states[1 - current];
+    const float* x = input.x.data();
+    const float* y = input.y.data();
+    const float* vx = input.vx.data();
+    const float* vy = input.vy.data();
+
+    for (int i = begin; i < end; ++i) {
+        float px = x[i], py = y[i], pvx = vx[i], pvy = vy[i];
+
+        // Loop through every other boid
+        Flock flock;
+        accumulate(params, flock, px, py, x, y, vx, vy, 0, i);
+        accumulate(params, flock, px, py, x, y, vx, vy, i + 1, numBoids);
+
+        steer(params, flock, px, py, pvx, pvy);
+        output.x[i] = px;
+        output.y[i] = py;
+        output.vx[i] = pvx;
+        output.vy[i] = pvy;
+    }
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <vector>
+#include "boid.hpp"
+#include "params.hpp"
+#include "simulation.hpp"
+#include "thread_pool.hpp"
+
+// Boid simulation in plain C++, with no OpenCL driver needed.
+//
+// The state is kept as a structure of arrays and double-buffered like the OpenCL
+// backend. A step bins the boids into the same uniform grid (a stable counting
+// sort into cell order), then every boid accumulates its neighbors from the 3x3
+// cells with AVX2 or SSE (whichever the compiler targets), spread over a
+// work-stealing thread pool. bruteForce compares every pair instead.
+class NativeSimulation : public Simulation {
+public:
+    // params.boids is ignored in favour of numBoids, and so are the populations; threads 0
+    // uses every hardware thread
+    NativeSimulation(const SimParams& params, int numBoids, bool bruteForce, unsigned threads = 0);
+
+    const char* name() const override { return bruteForce ? "native-brute-force" : "native-grid"; }
+    int size() const override { return numBoids; }
+
+    void upload(const Boid* boids) override;
+    void step() override;
+    void download(Boid* boids) override;
+
+    unsigned threads() const { return pool.size(); }
+
+    // Take the speed limit and the factors of the flocking rules for the next steps
+    // from rules (the radii size the grid and stay fixed)
+    void setRules(const SimParams& rules);
+
+private:
+    // Structure-of-arrays boid state
+    struct State {
+        std::vector<float> x, y, vx, vy;
+        void resize(int n);
+    };
+
+    // Bin the current state into cell order (sorted and sortedIndex)
+    void binBoids();
+    // Update the boids at sorted slots [begin, end) from their neighbor cells
+    void updateGrid(int begin, int end);
+    // Update the boids [begin, end) against every other boid
+    void updateBruteForce(int begin, int end);
+
+    SimParams params;
+    int numBoids;
+    bool bruteForce;
+    ThreadPool pool;
+
+    State states[2];
+    int current = 0;
+
+    // Uniform grid
+    float cellSize;
+    int gridW, gridH, numCells;
+    std::vector<int> boidCells;
+    std::vector<int> cellStarts;
+    std::vector<int> sortedIndex;
+    State sorted;
+};
@@ -0,0 +1,200 @@
+#include "params.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+bool SimParams::populations() const {
+    return species > 1 || !speciesRules.empty() || predators > 0 || !obstacles.empty() || !attractors.empty();
+}
+
+float SimParams::cellSize() const {
+    float radius = std::max(cohRadius, std::max(alignRadius, sepRadius));
+    return (predators > 0) ? std::max(radius, predatorRadius) : radius;
+}
+
+// Parse a whole string as a positive number
+static bool parsePositive(const std::string& text, float& value) {
+    char* end;
+    value = std::strtof(text.c_str(), &end);
+    return !text.empty() && *end == '\0' && value > 0.0f && value < 1e30f;
+}
+
+// Parse a whole string as an integer in [low, high]
+static bool parseInt(const std::string& text, int low, int high, int& value) {
+    char* end;
+    long parsed = std::strtol(text.c_str(), &end, 10);
+    if (text.empty() || *end != '\0' || parsed < low || parsed > high)
+        return false;
+    value = static_cast<int>(parsed);
+    return true;
+}
+
+// Parse "x y radius", with a positive radius
+static bool parseFieldSource(const std::string& text, FieldSource& source) {
+    std::istringstream stream(text);
+    std::string rest;
+    return (stream >> source.x >> source.y >> source.radius) && !(stream >> rest) && std::isfinite(source.x) &&
+           std::isfinite(source.y) && source.radius > 0.0f && source.radius < 1e30f;
+}
+
+// species.<n>.<rule>: one multiplier of species n
+static bool setSpeciesRule(SimParams& params, const std::string& key, const std::string& value) {
+    size_t dot = key.find('.', 8);
+    int index;
+    float multiplier;
+    if (dot == std::string::npos || !parseInt(key.substr(8, dot - 8), 0, MAX_SPECIES - 1, index) ||
+        !parsePositive(value, multiplier))
+        return false;
+
+    SpeciesRules rules;
+    if (index < static_cast<int>(params.speciesRules.size()))
+        rules = params.speciesRules[index];
+    std::string rule = key.substr(dot + 1);
+    if (rule == "cohesion")
+        rules.cohesion = multiplier;
+    else if (rule == "alignment")
+        rules.alignment = multiplier;
+    else if (rule == "separation")
+        rules.separation = multiplier;
+    else if (rule == "speed")
+        rules.speed = multiplier;
+    else
+        return false;
+
+    if (index >= static_cast<int>(params.speciesRules.size()))
+        params.speciesRules.resize(index + 1);
+    params.speciesRules[index] = rules;
+    return true;
+}
+
+bool setParam(SimParams& params, const std::string& key, const std::string& value) {
+    if (key == "boids")
+        return parseInt(value, 1, 100000000, params.boids);
+    if (key == "seed") {
+        char* end;
+        unsigned long long seed = std::strtoull(value.c_str(), &end, 10);
+        if (value.empty() || value[0] == '-' || *end != '\0' || seed > 0xffffffffull)
+            return false;
+        params.seed = static_cast<unsigned>(seed);
+        return true;
+    }
+    if (key == "deterministic") {
+        if (value != "0" && value != "1")
+            return false;
+        params.deterministic = value == "1";
+        return true;
+    }
+    if (key == "species")
+        return parseInt(value, 1, MAX_SPECIES, params.species);
+    if (key.compare(0, 8, "species.") == 0)
+        return setSpeciesRule(params, key, value);
+    if (key == "predators")
+        return parseInt(value, 0, 100000000, params.predators);
+    if (key == "obstacle" || key == "attractor") {
+        FieldSource source;
+        if (!parseFieldSource(value, source))
+            return false;
+        (key == "obstacle" ? params.obstacles : params.attractors).push_back(source);
+        return true;
+    }
+
+    float* field = nullptr;
+    if (key == "width")
+        field = &params.width;
+    else if (key == "height")
+        field = &params.height;
+    else if (key == "dt")
+        field = &params.dt;
+    else if (key == "cohesion_radius")
+        field = &params.cohRadius;
+    else if (key == "alignment_radius")
+        field = &params.alignRadius;
+    else if (key == "separation_radius")
+        field = &params.sepRadius;
+    else if (key == "max_speed")
+        field = &params.maxSpeed;
+    else if (key == "cohesion_factor")
+        field = &params.cohFactor;
+    else if (key == "alignment_factor")
+        field = &params.alignFactor;
+    else if (key == "separation_factor")
+        field = &params.sepFactor;
+    else if (key == "predator_radius")
+        field = &params.predatorRadius;
+    else if (key == "predator_speed")
+        field = &params.predatorSpeed;
+    else if (key == "flee_factor")
+        field = &params.fleeFactor;
+    else if (key == "obstacle_strength")
+        field = &params.obstacleStrength;
+    else if (key == "attractor_strength")
+        field = &params.attractorStrength;
+
+    return field != nullptr && parsePositive(value, *field);
+}
+
+// Strip surrounding blanks
+static std::string trim(const std::string& text) {
+    size_t begin = text.find_first_not_of(" \t\r");
+    if (begin == std::string::npos)
+        return std::string();
+    size_t end = text.find_last_not_of(" \t\r");
+    return text.substr(begin, end - begin + 1);
+}
+
+bool loadParams(const char* path, SimParams& params) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        std::cerr << "Failed to open " << path << std::endl;
+        return false;
+    }
+
+    std::string line;
+    for (int number = 1; std::getline(file, line); ++number) {
+        line = trim(line.substr(0, line.find('#')));
+        if (line.empty())
+            continue;
+
+        size_t equals = line.find('=');
+        if (equals == std::string::npos || !setParam(params, trim(line.substr(0, equals)), trim(line.substr(equals + 1)))) {
+            std::cerr << path << ":" << number << ": invalid parameter: " << line << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Shortest OpenCL C float literal that reads back as exactly the same value
+static std::string floatLiteral(float value) {
+    char text[32];
+    for (int precision = 6; precision <= 9; ++precision) {
+        std::snprintf(text, sizeof(text), "%.*g", precision, value);
+        if (std::strtof(text, NULL) == value)
+            break;
+    }
+    std::string literal = text;
+    if (literal.find_first_of(".e") == std::string::npos)
+        literal += ".0";
+    return literal + "f";
+}
+
+std::string kernelBuildOptions(const SimParams& params) {
+    return "-D COH_RADIUS=" + floatLiteral(params.cohRadius) +
+           " -D ALIGN_RADIUS=" + floatLiteral(params.alignRadius) +
+           " -D SEP_RADIUS=" + floatLiteral(params.sepRadius) +
+           " -D MAX_SPEED=" + floatLiteral(params.maxSpeed) +
+           " -D COH_FACTOR=" + floatLiteral(params.cohFactor) +
+           " -D ALIGN_FACTOR=" + floatLiteral(params.alignFactor) +
+           " -D SEP_FACTOR=" + floatLiteral(params.sepFactor) +
+           (params.deterministic ? " -D DETERMINISTIC" : "") +
+           (params.populations() ? " -D POPULATIONS -D SPECIES=" + std::to_string(params.species) +
+                                       " -D PREDATOR_RADIUS=" + floatLiteral(params.predatorRadius) +
+                                       " -D FLEE_FACTOR=" + floatLiteral(params.fleeFactor)
+                                 : "") +
+           (params.obstacles.empty() && params.attractors.empty() ? "" : " -D FIELD");
+}
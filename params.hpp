@@ -0,0 +1,94 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Largest species count: species ids, predators included, are stored in one byte
+const int MAX_SPECIES = 255;
+
+// Rule multipliers of one species (see SimParams::species)
+struct SpeciesRules {
+    float cohesion = 1.0f;
+    float alignment = 1.0f;
+    float separation = 1.0f;
+    float speed = 1.0f;
+};
+
+// Center and radius of influence of an obstacle or attractor
+struct FieldSource {
+    float x, y, radius;
+};
+
+// Simulation parameters, loaded from a config file and/or command line flags.
+//
+// The OpenCL kernels get the flocking rules as -D defines (see kernelBuildOptions),
+// so the compiler can fold them into the code; the world size and time step are
+// kernel arguments. The native backend reads everything from here.
+struct SimParams {
+    // Number of boids, and the seed of their random initial state
+    int boids = 5000;
+    unsigned seed = 1;
+
+    // World size
+    float width = 1920.0f;
+    float height = 1080.0f;
+    // Time step of one simulation step
+    float dt = 0.1f;
+
+    // Flocking rules
+    float cohRadius = 20.0f;
+    float alignRadius = 30.0f;
+    float sepRadius = 10.0f;
+    float maxSpeed = 10.0f;
+
+    float cohFactor = 0.01f;
+    float alignFactor = 0.05f;
+    float sepFactor = 0.2f;
+
+    // Reproducible runs on one device: the OpenCL kernels accumulate neighbors in a fixed
+    // order and are built without contracting floating point operations (see ClSimulation)
+    bool deterministic = false;
+
+    // Populations, only run by the OpenCL grid kernel (see population.hpp). The boids
+    // are dealt out to `species` flocks that only cohere and align with their own kind,
+    // each with its own multipliers of the rule factors and speed limit (missing entries
+    // of speciesRules default to 1). The first `predators` boids chase every other boid
+    // within predatorRadius, at predatorSpeed times the speed limit, and the others flee
+    // from them.
+    int species = 1;
+    std::vector<SpeciesRules> speciesRules;
+    int predators = 0;
+    float predatorRadius = 50.0f;
+    float predatorSpeed = 1.25f;
+    float fleeFactor = 0.5f;
+
+    // Static steering field: obstacles push boids out of their radius, attractors pull
+    // them in, both by their strength times how close to the center the boid is
+    std::vector<FieldSource> obstacles;
+    std::vector<FieldSource> attractors;
+    float obstacleStrength = 2.0f;
+    float attractorStrength = 0.2f;
+
+    // Whether any of the population features is in use
+    bool populations() const;
+
+    // Side of a neighbor-search cell: the largest radius, so the 3x3 cells around a
+    // boid always cover every boid that can influence it
+    float cellSize() const;
+};
+
+// Set one parameter by its config key (boids, seed, width, height, dt, cohesion_radius,
+// alignment_radius, separation_radius, max_speed, cohesion_factor, alignment_factor,
+// separation_factor, deterministic, species, species.<n>.cohesion, species.<n>.alignment,
+// species.<n>.separation, species.<n>.speed, predators, predator_radius, predator_speed,
+// flee_factor, obstacle, attractor, obstacle_strength, attractor_strength). obstacle and
+// attractor take "x y radius" and add one more source every time they are set.
+// Returns false for unknown keys and invalid values.
+bool setParam(SimParams& params, const std::string& key, const std::string& value);
+
+// Read "key = value" lines from a file; '#' starts a comment. Errors are printed with
+// their line number.
+bool loadParams(const char* path, SimParams& params);
+
+// clBuildProgram options defining the flocking rules of boid.cl
+std::string kernelBuildOptions(const SimParams& params);
@@ -0,0 +1,66 @@
+#include "population.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+std::vector<uint8_t> assignSpecies(const SimParams& params, int numBoids) {
+    std::vector<uint8_t> species(numBoids);
+    int predators = std::min(params.predators, numBoids);
+    for (int i = 0; i < numBoids; ++i)
+        species[i] = static_cast<uint8_t>((i < predators) ? params.species : (i - predators) % params.species);
+    return species;
+}
+
+std::vector<float> speciesRuleTable(const SimParams& params) {
+    std::vector<float> table;
+    for (int s = 0; s <= params.species; ++s) {
+        SpeciesRules rules;
+        if (s == params.species)
+            rules.speed = params.predatorSpeed;
+        else if (s < static_cast<int>(params.speciesRules.size()))
+            rules = params.speciesRules[s];
+        table.insert(table.end(), {rules.cohesion, rules.alignment, rules.separation, rules.speed});
+    }
+    return table;
+}
+
+// Add the pull (negative strength: push) of every source, fading linearly from strength at
+// the center to nothing at the radius
+static void addSources(const std::vector<FieldSource>& sources, float strength, float x, float y, float* velocity) {
+    for (const FieldSource& source : sources) {
+        float dx = source.x - x;
+        float dy = source.y - y;
+        float dist = std::sqrt(dx * dx + dy * dy);
+        if (dist >= source.radius || dist == 0.0f)
+            continue;
+        float scale = strength * (1.0f - dist / source.radius) / dist;
+        velocity[0] += dx * scale;
+        velocity[1] += dy * scale;
+    }
+}
+
+std::vector<float> buildField(const SimParams& params, int& fieldW, int& fieldH) {
+    fieldW = std::max(1, static_cast<int>(std::ceil(params.width / FIELD_CELL)));
+    fieldH = std::max(1, static_cast<int>(std::ceil(params.height / FIELD_CELL)));
+    std::vector<float> field(2 * fieldW * fieldH, 0.0f);
+    for (int cy = 0; cy < fieldH; ++cy) {
+        for (int cx = 0; cx < fieldW; ++cx) {
+            float* velocity = &field[2 * (cy * fieldW + cx)];
+            float x = (cx + 0.5f) * FIELD_CELL;
+            float y = (cy + 0.5f) * FIELD_CELL;
+            addSources(params.obstacles, -params.obstacleStrength, x, y, velocity);
+            addSources(params.attractors, params.attractorStrength, x, y, velocity);
+        }
+    }
+    return field;
+}
+
+SimParams plainFlocking(const SimParams& params) {
+    SimParams plain = params;
+    plain.species = 1;
+    plain.speciesRules.clear();
+    plain.predators = 0;
+    plain.obstacles.clear();
+    plain.attractors.clear();
+    return plain;
+}
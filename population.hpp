@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "params.hpp"
+
+// Host side of the populations of SimParams, uploaded by ClSimulation for the fused
+// grid update of boid.cl.
+//
+// Species ids are 0 to params.species - 1, and params.species for predators. The state
+// is reordered by the spatial sort, so the species of every boid moves along with it.
+
+// Side of a cell of the steering field, in world units
+const float FIELD_CELL = 8.0f;
+
+// Species of every boid in upload order: the first params.predators boids are predators,
+// the others are dealt out to the species in turn
+std::vector<uint8_t> assignSpecies(const SimParams& params, int numBoids);
+
+// Multipliers of cohesion, alignment, separation and the speed limit, four floats per
+// species, predators last
+std::vector<float> speciesRuleTable(const SimParams& params);
+
+// Velocity change of the obstacles and attractors at the center of every field cell,
+// two floats per cell, row by row; fieldW and fieldH receive the size of the grid
+std::vector<float> buildField(const SimParams& params, int& fieldW, int& fieldH);
+
+// The same world and flocking rules without any population feature, the baseline the
+// benchmark compares them against
+SimParams plainFlocking(const SimParams& params);
@@ -0,0 +1,51 @@
+#include "program_cache.hpp"
+
+#include "cl_setup.hpp"
+
+ProgramCache::ProgramCache(cl_context context, cl_device_id device, const std::string& source, size_t capacity)
+    : context(context), device(device), source(source), capacity(capacity) {}
+
+ProgramCache::~ProgramCache() {
+    for (auto& entry : programs)
+        clReleaseProgram(entry.second);
+}
+
+cl_program ProgramCache::find(const std::string& options) {
+    for (auto it = programs.begin(); it != programs.end(); ++it) {
+        if (it->first == options) {
+            programs.splice(programs.begin(), programs, it);
+            clRetainProgram(it->second);
+            return it->second;
+        }
+    }
+    return NULL;
+}
+
+cl_program ProgramCache::get(const std::string& options) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        cl_program cached = find(options);
+        if (cached != NULL)
+            return cached;
+    }
+
+    // Build without holding the lock
+    cl_program program = buildProgram(context, device, source, options);
+    if (program == NULL)
+        return NULL;
+
+    // Another thread may have cached the same key meanwhile: keep its build
+    std::lock_guard<std::mutex> lock(mutex);
+    cl_program cached = find(options);
+    if (cached != NULL) {
+        clReleaseProgram(program);
+        return cached;
+    }
+    clRetainProgram(program);
+    programs.emplace_front(options, program);
+    if (programs.size() > capacity) {
+        clReleaseProgram(programs.back().second);
+        programs.pop_back();
+    }
+    return program;
+}
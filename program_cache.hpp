@@ -0,0 +1,46 @@
+#pragma once
+
+// Define the target OpenCL version
+#define CL_TARGET_OPENCL_VERSION 300
+
+#include <list>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <CL/cl.h>
+
+// Programs built from one source for one device, keyed by their build options (which
+// encode the parameter set, see kernelBuildOptions). Switching back to a parameter set
+// that was used recently does not rebuild anything. The least recently used program
+// is dropped once more than capacity are cached.
+//
+// get() may be called from several threads; builds of different keys run in parallel.
+// Two misses on the same key may both build it, but only the first build is cached
+// and returned to both.
+class ProgramCache {
+public:
+    ProgramCache(cl_context context, cl_device_id device, const std::string& source, size_t capacity = 8);
+    ~ProgramCache();
+
+    ProgramCache(const ProgramCache&) = delete;
+    ProgramCache& operator=(const ProgramCache&) = delete;
+
+    // Program built with options, built now on a miss (see buildProgram). The caller
+    // owns one reference and releases it with clReleaseProgram. Failed builds return
+    // NULL and are not cached.
+    cl_program get(const std::string& options);
+
+private:
+    // Cached program with options moved to the front and retained once more, or NULL.
+    // The mutex must be held.
+    cl_program find(const std::string& options);
+
+    cl_context context;
+    cl_device_id device;
+    std::string source;
+    size_t capacity;
+
+    // Most recently used first
+    std::mutex mutex;
+    std::list<std::pair<std::string, cl_program>> programs;
+};
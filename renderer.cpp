@@ -0,0 +1,138 @@
+// Ask the GL headers for the buffer object entry points
+#define GL_GLEXT_PROTOTYPES
+
+#include "renderer.hpp"
+
+#include <cstring>
+#include <iostream>
+#include <CL/cl_gl.h>
+#include <SFML/OpenGL.hpp>
+#if !defined(_WIN32) && !defined(__APPLE__)
+#include <GL/glx.h>
+#endif
+
+bool BoidRenderer::interopSupported(cl_device_id device) {
+    size_t extensions_size;
+    clGetDeviceInfo(device, CL_DEVICE_EXTENSIONS, 0, NULL, &extensions_size);
+    std::vector<char> extensions(extensions_size + 1, '\0');
+    clGetDeviceInfo(device, CL_DEVICE_EXTENSIONS, extensions_size, extensions.data(), NULL);
+    return std::strstr(extensions.data(), "cl_khr_gl_sharing") != nullptr;
+}
+
+std::vector<cl_context_properties> BoidRenderer::interopContextProperties(cl_platform_id platform) {
+#if !defined(_WIN32) && !defined(__APPLE__)
+    // GLX: share with the context SFML made current for the window
+    return {
+        CL_GL_CONTEXT_KHR, reinterpret_cast<cl_context_properties>(glXGetCurrentContext()),
+        CL_GLX_DISPLAY_KHR, reinterpret_cast<cl_context_properties>(glXGetCurrentDisplay()),
+        CL_CONTEXT_PLATFORM, reinterpret_cast<cl_context_properties>(platform),
+        0
+    };
+#else
+    // Only GLX is wired up; other platforms use the host fallback
+    (void)platform;
+    return {};
+#endif
+}
+
+BoidRenderer::BoidRenderer(sf::RenderWindow& window, int numBoids, cl_context context, cl_program program)
+    : window(window), numBoids(numBoids) {
+    if (context != NULL) {
+        window.setActive(true);
+
+        // Create the vertex buffer holding one float2 position per boid
+        glGenBuffers(1, &vertexBuffer);
+        glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(float) * 2 * numBoids, nullptr, GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+        // Share it with OpenCL and create the kernel that fills it
+        cl_int shared_result;
+        sharedBuffer = clCreateFromGLBuffer(context, CL_MEM_WRITE_ONLY, vertexBuffer, &shared_result);
+        cl_int kernel_result = CL_INVALID_VALUE;
+        if (shared_result == CL_SUCCESS)
+            positionsKernel = clCreateKernel(program, "write_positions", &kernel_result);
+
+        if (kernel_result == CL_SUCCESS) {
+            clSetKernelArg(positionsKernel, 1, sizeof(cl_mem), &sharedBuffer);
+            clSetKernelArg(positionsKernel, 2, sizeof(int), &numBoids);
+            interop = true;
+        } else {
+            std::cerr << "OpenCL-OpenGL sharing failed, falling back to host rendering." << std::endl;
+            if (sharedBuffer != NULL)
+                clReleaseMemObject(sharedBuffer);
+            sharedBuffer = NULL;
+            glDeleteBuffers(1, &vertexBuffer);
+            vertexBuffer = 0;
+        }
+    }
+
+    if (!interop) {
+        vertices.setPrimitiveType(sf::Points);
+        vertices.resize(numBoids);
+    }
+}
+
+BoidRenderer::~BoidRenderer() {
+    if (positionsKernel != NULL)
+        clReleaseKernel(positionsKernel);
+    if (sharedBuffer != NULL)
+        clReleaseMemObject(sharedBuffer);
+    if (vertexBuffer != 0) {
+        window.setActive(true);
+        glDeleteBuffers(1, &vertexBuffer);
+    }
+}
+
+void BoidRenderer::updateFromDevice(cl_command_queue queue, cl_mem boids) {
+    // GL must be done with the buffer before OpenCL acquires it
+    window.setActive(true);
+    glFinish();
+
+    clEnqueueAcquireGLObjects(queue, 1, &sharedBuffer, 0, NULL, NULL);
+    clSetKernelArg(positionsKernel, 0, sizeof(cl_mem), &boids);
+    size_t globalWorkSize = numBoids;
+    clEnqueueNDRangeKernel(queue, positionsKernel, 1, NULL, &globalWorkSize, NULL, 0, NULL, NULL);
+    clEnqueueReleaseGLObjects(queue, 1, &sharedBuffer, 0, NULL, NULL);
+
+    // And OpenCL must be done with it before GL draws from it
+    clFinish(queue);
+}
+
+void BoidRenderer::updateFromHost(const Boid* boids) {
+    for (int i = 0; i < numBoids; ++i) {
+        vertices[i].position = sf::Vector2f(boids[i].x, boids[i].y);
+        vertices[i].color = sf::Color::White;
+    }
+}
+
+void BoidRenderer::draw() {
+    if (!interop) {
+        window.draw(vertices);
+        return;
+    }
+
+    window.setActive(true);
+
+    // Map world coordinates to the window, with y pointing down like SFML
+    sf::Vector2u size = window.getSize();
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    glOrtho(0.0, size.x, size.y, 0.0, -1.0, 1.0);
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+    glDisable(GL_TEXTURE_2D);
+
+    // Draw every boid as a point sprite straight from the shared buffer
+    glPointSize(2.0f);
+    glColor3f(1.0f, 1.0f, 1.0f);
+    glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glVertexPointer(2, GL_FLOAT, 0, nullptr);
+    glDrawArrays(GL_POINTS, 0, numBoids);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    // Hand the GL state back to SFML for the overlay
+    window.resetGLStates();
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+// Define the target OpenCL version
+#define CL_TARGET_OPENCL_VERSION 300
+
+#include <vector>
+#include <CL/cl.h>
+#include <SFML/Graphics.hpp>
+#include "boid.hpp"
+
+// Draws all boids with a single draw call.
+//
+// With cl_khr_gl_sharing the boid positions are written by an OpenCL kernel straight
+// into a GL vertex buffer that is drawn as points, so nothing goes through host memory.
+// Without it, positions are copied from a host pointer into one sf::VertexArray.
+class BoidRenderer {
+public:
+    // Whether the device can share buffers with the GL context of the window
+    static bool interopSupported(cl_device_id device);
+
+    // Context properties that share the OpenCL context with the current GL context.
+    // The window must be active on the calling thread.
+    static std::vector<cl_context_properties> interopContextProperties(cl_platform_id platform);
+
+    // Uses the interop path when context is non-null (it must have been created with
+    // interopContextProperties), and the host fallback otherwise
+    BoidRenderer(sf::RenderWindow& window, int numBoids, cl_context context, cl_program program);
+    ~BoidRenderer();
+
+    BoidRenderer(const BoidRenderer&) = delete;
+    BoidRenderer& operator=(const BoidRenderer&) = delete;
+
+    bool usesInterop() const { return interop; }
+
+    // Interop path: write the positions of boids (a device buffer) into the vertex buffer
+    void updateFromDevice(cl_command_queue queue, cl_mem boids);
+
+    // Fallback path: copy the positions of boids (host memory) into the vertex array
+    void updateFromHost(const Boid* boids);
+
+    // Draw every boid in one call
+    void draw();
+
+private:
+    sf::RenderWindow& window;
+    int numBoids;
+    bool interop = false;
+
+    // Interop path
+    unsigned int vertexBuffer = 0;
+    cl_mem sharedBuffer = NULL;
+    cl_kernel positionsKernel = NULL;
+
+    // Fallback path
+    sf::VertexArray vertices;
+};
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "boid.hpp"
+
+// Common interface of the simulation backends (OpenCL and native C++).
+// A backend owns the boid state; the host only uploads it, advances it and
+// copies it back for rendering.
+class Simulation {
+public:
+    virtual ~Simulation() = default;
+
+    // Short backend name used in benchmark output
+    virtual const char* name() const = 0;
+
+    virtual int size() const = 0;
+
+    // Replace the whole state
+    virtual void upload(const Boid* boids) = 0;
+
+    // Advance the state by one step. Backends may run it asynchronously, but the
+    // effects of every step are visible to the next step and to download.
+    virtual void step() = 0;
+
+    // Copy the latest state into boids (blocking)
+    virtual void download(Boid* boids) = 0;
+};
@@ -0,0 +1,89 @@
+#include "thread_pool.hpp"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(unsigned threads) {
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+
+    queues.reset(new Queue[threads]);
+    for (unsigned i = 1; i < threads; ++i)
+        workers.emplace_back(&ThreadPool::workerLoop, this, i);
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread& worker : workers)
+        worker.join();
+}
+
+void ThreadPool::parallelFor(int count, int grain, const std::function<void(int, int)>& fn) {
+    grain = std::max(1, grain);
+    int numChunks = (count + grain - 1) / grain;
+    if (numChunks <= 1 || workers.empty()) {
+        if (count > 0)
+            fn(0, count);
+        return;
+    }
+
+    // Hand every participant an equal share of the chunks
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job = &fn;
+        this->count = count;
+        this->grain = grain;
+        unsigned participants = size();
+        for (unsigned i = 0; i < participants; ++i) {
+            queues[i].next.store(static_cast<int>(static_cast<int64_t>(numChunks) * i / participants), std::memory_order_relaxed);
+            queues[i].end = static_cast<int>(static_cast<int64_t>(numChunks) * (i + 1) / participants);
+        }
+        active = static_cast<unsigned>(workers.size());
+        ++generation;
+    }
+    wake.notify_all();
+
+    // The caller takes part as participant 0
+    work(0);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this] { return active == 0; });
+    job = nullptr;
+}
+
+void ThreadPool::workerLoop(unsigned index) {
+    uint64_t seen = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&] { return stopping || generation != seen; });
+            if (stopping)
+                return;
+            seen = generation;
+        }
+
+        work(index);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--active == 0)
+            done.notify_one();
+    }
+}
+
+void ThreadPool::work(unsigned self) {
+    // Drain our own range first, then steal from the others in turn
+    unsigned participants = size();
+    for (unsigned k = 0; k < participants; ++k) {
+        Queue& queue = queues[(self + k) % participants];
+        while (true) {
+            int chunk = queue.next.fetch_add(1, std::memory_order_relaxed);
+            if (chunk >= queue.end)
+                break;
+            int begin = chunk * grain;
+            (*job)(begin, std::min(begin + grain, count));
+        }
+    }
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads running parallel loops with work stealing.
+//
+// A loop is cut into chunks and every participant (the workers plus the calling
+// thread) gets an equal, contiguous range of them. Each participant drains its own
+// range first and then steals chunks from the ranges of the others, so uneven
+// chunks (e.g. crowded grid cells) do not leave cores idle.
+class ThreadPool {
+public:
+    // threads is the total number of participants including the caller,
+    // 0 uses every hardware thread
+    explicit ThreadPool(unsigned threads = 0);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    unsigned size() const { return static_cast<unsigned>(workers.size()) + 1; }
+
+    // Call fn(begin, end) over [0, count) in chunks of at most grain items and
+    // return once all of them are done
+    void parallelFor(int count, int grain, const std::function<void(int, int)>& fn);
+
+private:
+    // Range of chunk indices owned by one participant
+    struct alignas(64) Queue {
+        std::atomic<int> next{0};
+        int end = 0;
+    };
+
+    void workerLoop(unsigned index);
+    void work(unsigned self);
+
+    std::vector<std::thread> workers;
+    std::unique_ptr<Queue[]> queues;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    uint64_t generation = 0;
+    unsigned active = 0;
+    bool stopping = false;
+
+    // Current loop
+    const std::function<void(int, int)>* job = nullptr;
+    int count = 0;
+    int grain = 1;
+};
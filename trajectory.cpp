@@ -0,0 +1,213 @@
+#include "trajectory.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <iterator>
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static const char trajectoryMagic[8] = "BOIDTRJ";
+static const uint32_t trajectoryVersion = 2;
+// Frames per chunk, a chunk is written as soon as it is full or the writer runs idle
+static const uint32_t chunkCapacity = 32;
+
+// Position in [0, extent] as 16-bit fixed point
+static uint16_t quantize(float value, float scale) {
+    float q = value * scale + 0.5f;
+    return static_cast<uint16_t>(std::min(std::max(q, 0.0f), 65535.0f));
+}
+
+TrajectoryRecorder::TrajectoryRecorder(int numBoids, float width, float height, int interval, int buffers)
+    : numBoids(numBoids), width(width), height(height), steps(std::max(1, interval)),
+      frames(std::max(1, buffers), std::vector<Boid>(numBoids)) {
+    for (std::vector<Boid>& frame : frames)
+        freeFrames.push_back(frame.data());
+}
+
+TrajectoryRecorder::~TrajectoryRecorder() {
+    close();
+}
+
+bool TrajectoryRecorder::open(const std::string& path) {
+    file.open(path, std::ios::binary | std::ios::trunc);
+    if (!file.is_open())
+        return false;
+
+    TrajectoryHeader header = {};
+    std::memcpy(header.magic, trajectoryMagic, sizeof(header.magic));
+    header.version = trajectoryVersion;
+    header.numBoids = static_cast<uint32_t>(numBoids);
+    header.width = width;
+    header.height = height;
+    header.interval = static_cast<uint32_t>(steps);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    chunk.reserve(static_cast<size_t>(chunkCapacity) * numBoids * 2);
+    writer = std::thread(&TrajectoryRecorder::writerLoop, this);
+    return true;
+}
+
+void TrajectoryRecorder::close() {
+    if (!writer.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_one();
+    writer.join();
+    file.close();
+}
+
+Boid* TrajectoryRecorder::acquire(bool wait) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (wait)
+        released.wait(lock, [this] { return !freeFrames.empty(); });
+    if (freeFrames.empty()) {
+        ++skipped;
+        return nullptr;
+    }
+    Boid* frame = freeFrames.back();
+    freeFrames.pop_back();
+    return frame;
+}
+
+void TrajectoryRecorder::submit(Boid* frame, uint64_t step, cl_event ready) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.push_back({frame, step, ready});
+    }
+    wake.notify_one();
+}
+
+void TrajectoryRecorder::writerLoop() {
+    float scaleX = 65535.0f / width;
+    float scaleY = 65535.0f / height;
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        // Write out what has been gathered whenever there is nothing else to do
+        if (pending.empty() && chunkFrames > 0) {
+            lock.unlock();
+            writeChunk();
+            lock.lock();
+        }
+        wake.wait(lock, [this] { return stopping || !pending.empty(); });
+        if (pending.empty())
+            break;
+
+        Pending next = pending.front();
+        pending.pop_front();
+        lock.unlock();
+
+        // Wait for the device copy here, never on the simulation thread
+        if (next.ready != NULL) {
+            clWaitForEvents(1, &next.ready);
+            clReleaseEvent(next.ready);
+        }
+        // Frames were dropped since the last one: start a new chunk at this step
+        if (chunkFrames > 0 && next.step != chunkStep + static_cast<uint64_t>(chunkFrames) * steps)
+            writeChunk();
+        if (chunkFrames == 0)
+            chunkStep = next.step;
+        for (int i = 0; i < numBoids; ++i) {
+            chunk.push_back(quantize(next.frame[i].x, scaleX));
+            chunk.push_back(quantize(next.frame[i].y, scaleY));
+        }
+        if (++chunkFrames == chunkCapacity)
+            writeChunk();
+
+        lock.lock();
+        freeFrames.push_back(next.frame);
+        released.notify_one();
+    }
+}
+
+void TrajectoryRecorder::writeChunk() {
+    TrajectoryChunk header = {chunkStep, chunkFrames, 0};
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(chunk.data()), sizeof(uint16_t) * chunk.size());
+    file.flush();
+    written += static_cast<int>(chunkFrames);
+    chunkFrames = 0;
+    chunk.clear();
+}
+
+TrajectoryReader::~TrajectoryReader() {
+#if !defined(_WIN32)
+    if (data != nullptr && fallback.empty())
+        munmap(const_cast<unsigned char*>(data), length);
+#endif
+}
+
+bool TrajectoryReader::open(const std::string& path) {
+#if !defined(_WIN32)
+    int fd = ::open(path.c_str(), O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        if (fd >= 0)
+            ::close(fd);
+        std::cerr << "Failed to open " << path << std::endl;
+        return false;
+    }
+    length = static_cast<size_t>(info.st_size);
+    void* mapped = length > 0 ? mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    ::close(fd);
+    if (mapped != MAP_FAILED)
+        data = static_cast<const unsigned char*>(mapped);
+#else
+    // No mmap: read the whole file instead
+    std::ifstream in(path, std::ios::binary);
+    if (!in.is_open()) {
+        std::cerr << "Failed to open " << path << std::endl;
+        return false;
+    }
+    fallback.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    data = fallback.data();
+    length = fallback.size();
+#endif
+
+    if (data == nullptr || length < sizeof(TrajectoryHeader) ||
+        std::memcmp(header().magic, trajectoryMagic, sizeof(trajectoryMagic)) != 0 ||
+        header().version != trajectoryVersion || header().numBoids == 0) {
+        std::cerr << path << ": not a trajectory file" << std::endl;
+        return false;
+    }
+    numBoids = static_cast<int>(header().numBoids);
+    width = header().width;
+    height = header().height;
+
+    // Index every frame, stopping at a chunk that was cut short
+    size_t frameBytes = sizeof(uint16_t) * 2 * numBoids;
+    size_t offset = sizeof(TrajectoryHeader);
+    while (offset + sizeof(TrajectoryChunk) <= length) {
+        TrajectoryChunk chunk;
+        std::memcpy(&chunk, data + offset, sizeof(chunk));
+        offset += sizeof(chunk);
+        uint32_t complete = static_cast<uint32_t>(std::min<size_t>(chunk.frames, (length - offset) / frameBytes));
+        for (uint32_t i = 0; i < complete; ++i) {
+            frameData.push_back(reinterpret_cast<const uint16_t*>(data + offset + i * frameBytes));
+            frameSteps.push_back(chunk.firstStep + static_cast<uint64_t>(i) * header().interval);
+        }
+        if (complete < chunk.frames)
+            break;
+        offset += chunk.frames * frameBytes;
+    }
+    return true;
+}
+
+void TrajectoryReader::frame(int index, Boid* boids) const {
+    const uint16_t* positions = frameData[index];
+    float scaleX = width / 65535.0f;
+    float scaleY = height / 65535.0f;
+    for (int i = 0; i < numBoids; ++i) {
+        boids[i].x = positions[2 * i] * scaleX;
+        boids[i].y = positions[2 * i + 1] * scaleY;
+        boids[i].vx = 0.0f;
+        boids[i].vy = 0.0f;
+    }
+}
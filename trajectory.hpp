@@ -0,0 +1,142 @@
+#pragma once
+
+// Define the target OpenCL version
+#define CL_TARGET_OPENCL_VERSION 300
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <CL/cl.h>
+#include "boid.hpp"
+
+// Trajectory files hold the boid positions of every recorded frame.
+//
+// A file is a TrajectoryHeader followed by chunks, each a TrajectoryChunk and then
+// `frames` frames of numBoids (x, y) pairs. Positions are 16-bit fixed point over the
+// world, x = q * width / 65535, which keeps them to a quarter of a Boid. Chunks are
+// written whole, so a file cut short by a crash still replays up to its last chunk.
+// The frames of a chunk are `interval` steps apart; a dropped frame ends the chunk, so
+// the step of every frame is known.
+struct TrajectoryHeader {
+    char magic[8];       // "BOIDTRJ" and a NUL
+    uint32_t version;
+    uint32_t numBoids;
+    float width, height;
+    uint32_t interval;   // Simulation steps between two frames
+    uint32_t reserved;
+};
+
+struct TrajectoryChunk {
+    uint64_t firstStep;  // Simulation step of the first frame
+    uint32_t frames;
+    uint32_t reserved;
+};
+
+// Writes every frame handed to it into a trajectory file on a writer thread.
+//
+// The caller takes a free frame buffer, fills it (with a blocking copy or an async
+// OpenCL read) and submits it. The writer waits for the read, quantizes the frame and
+// writes it out in chunks. When every buffer is still queued the frame is dropped
+// instead of waiting, so recording never stalls the simulation loop, unless the caller
+// asks to wait (headless runs, which have no frame rate to keep).
+class TrajectoryRecorder {
+public:
+    // buffers is the number of frames that may be in flight at once
+    TrajectoryRecorder(int numBoids, float width, float height, int interval, int buffers = 8);
+    ~TrajectoryRecorder();
+
+    TrajectoryRecorder(const TrajectoryRecorder&) = delete;
+    TrajectoryRecorder& operator=(const TrajectoryRecorder&) = delete;
+
+    // Create path and start the writer. False when it cannot be created.
+    bool open(const std::string& path);
+
+    // Flush every submitted frame and close the file
+    void close();
+
+    int interval() const { return steps; }
+
+    // Buffer for the next frame. When none is free, waits for the writer to release one
+    // with wait, and otherwise returns nullptr (the frame is dropped).
+    Boid* acquire(bool wait = false);
+
+    // Queue a buffer from acquire, holding the state after simulation step `step`. When
+    // ready is given, the writer waits for it before reading the buffer and then
+    // releases it.
+    void submit(Boid* frame, uint64_t step, cl_event ready = NULL);
+
+    // Frames written and dropped, final once the recorder is closed
+    int recorded() const { return written; }
+    int dropped() const { return skipped; }
+
+private:
+    void writerLoop();
+    void writeChunk();
+
+    struct Pending {
+        Boid* frame;
+        uint64_t step;
+        cl_event ready;
+    };
+
+    int numBoids;
+    float width, height;
+    int steps;
+
+    std::ofstream file;
+    std::thread writer;
+    std::vector<std::vector<Boid>> frames;
+    std::vector<Boid*> freeFrames;
+    std::deque<Pending> pending;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable released;
+    bool stopping = false;
+
+    // Writer side: quantized frames of the chunk being assembled
+    std::vector<uint16_t> chunk;
+    uint32_t chunkFrames = 0;
+    uint64_t chunkStep = 0;
+    int written = 0;
+    int skipped = 0;
+};
+
+// Read-only view of a trajectory file, mapped into memory.
+class TrajectoryReader {
+public:
+    TrajectoryReader() = default;
+    ~TrajectoryReader();
+
+    TrajectoryReader(const TrajectoryReader&) = delete;
+    TrajectoryReader& operator=(const TrajectoryReader&) = delete;
+
+    // Map path and index its frames. False (with a message on std::cerr) when it is
+    // not a trajectory file.
+    bool open(const std::string& path);
+
+    int size() const { return numBoids; }
+    int frames() const { return static_cast<int>(frameData.size()); }
+    const TrajectoryHeader& header() const { return *reinterpret_cast<const TrajectoryHeader*>(data); }
+
+    // Positions of one frame; velocities are not recorded and come out as zero
+    void frame(int index, Boid* boids) const;
+
+    // Simulation step of one frame
+    uint64_t step(int index) const { return frameSteps[index]; }
+
+private:
+    const unsigned char* data = nullptr;
+    size_t length = 0;
+    std::vector<unsigned char> fallback;  // File contents where mmap is not available
+
+    int numBoids = 0;
+    float width = 0.0f, height = 0.0f;
+    std::vector<const uint16_t*> frameData;
+    std::vector<uint64_t> frameSteps;
+};